@@ -0,0 +1,2903 @@
+/*
+ * Copyright (c) 2017-2020 Vadim Mikhailov
+ *
+ * libuhidctl - library to control USB HID power relays.
+ *
+ * This file can be distributed under the terms and conditions of the
+ * GNU General Public License version 2.
+ *
+ */
+
+#define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE   /* for syscall() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <wchar.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#define strcasecmp _stricmp
+#define strncasecmp _strnicmp
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/netlink.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+#endif
+
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <hidapi/hidapi.h>
+
+#include "uhidctl.h"
+
+
+/*
+ * Relay feature report layout: 5 bytes of serial number, 2 reserved bytes,
+ * then port state bitmap, least significant byte first (1 byte per 8 ports).
+ */
+#define RELAY_STATE_OFFSET  7
+#define RELAY_REPORT_SIZE   (RELAY_STATE_OFFSET + UHID_MAX_PORTS / 8)
+
+/* Relay output report opcodes */
+#define RELAY_CMD_ALL_ON    0xFE
+#define RELAY_CMD_ALL_OFF   0xFC
+#define RELAY_CMD_ON        0xFF
+#define RELAY_CMD_OFF       0xFD
+#define RELAY_CMD_SERIAL    0xFA
+
+/* Root of sysfs, where USB topology is found (Linux only) */
+#ifndef UHID_SYSFS
+#define UHID_SYSFS  "/sys"
+#endif
+
+/* Device paths one USB location may have, see location_paths() */
+#define LOCATION_PATHS   8
+
+/* Commands queued at once by uhid_get_bitmaps() and uhid_set_serials(), they live on stack */
+#define READ_BATCH       64
+
+#define RELAY_OP_READ    0
+#define RELAY_OP_WRITE   1
+#define RELAY_OP_STOP    2
+#define RELAY_OP_SERIAL  3
+
+/* Request to relay worker thread, see relay_call() */
+struct relay_cmd {
+    struct relay_cmd* next;          /* link in worker queue */
+    int op;                          /* RELAY_OP_xxx */
+    int async;                       /* part of struct uhid_op */
+    uint32_t mask;                   /* RELAY_OP_WRITE: ports to change */
+    uint32_t value;                  /* RELAY_OP_WRITE: their new state */
+    const char* serial;              /* RELAY_OP_SERIAL: new serial number */
+    uint32_t result;                 /* relay state after command */
+    int rc;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;             /* signaled when command is done */
+};
+
+/* Asynchronous command, completed with callback or to context queue */
+struct uhid_op {
+    struct relay_cmd cmd;            /* must be first */
+    struct uhid_relay* relay;        /* referenced until op is freed */
+    uhid_op_cb cb;
+    void* user;
+    struct uhid_op* done_next;       /* link in ctx completion queue */
+};
+
+/*
+ * Relays sharing USB bus or hub, whose transfers contend with each other.
+ * Lanes live until context is freed.
+ */
+struct lane {
+    struct lane* next;
+    char key[256];                   /* bus or hub location, or device path */
+    int active;                      /* batches running */
+    pthread_cond_t cond;             /* signaled when batch is done */
+};
+
+/* Max write rate of relay (by serial number) or of relay model */
+struct rate_rule {
+    char key[16];
+    double interval;                 /* ms between writes */
+};
+
+/*
+ * Intrusive lock-free multi-producer single-consumer queue.
+ * Any thread may push, only relay worker pops.
+ */
+struct cmd_queue {
+    struct relay_cmd* head;          /* last pushed command */
+    struct relay_cmd* tail;          /* next command to pop */
+    struct relay_cmd stub;
+};
+
+struct uhid_relay {
+    struct uhid_ctx* ctx;
+    char serial[16];
+    int  nports;
+    char path[256];
+    int  id;                         /* slot in ctx->relays[] */
+    int  refs;                       /* registry and users */
+    int  seen;                       /* found by current enumeration */
+    struct uhid_relay* serial_next;  /* hash chain by serial */
+    struct uhid_relay* path_next;    /* hash chain by path */
+
+    /* Device handle and state cache, only used with io_lock held */
+    pthread_mutex_t io_lock;
+    hid_device* handle;
+    int hidraw_fd;                   /* /dev/hidrawN for io_uring writes, or -1 */
+    uint32_t cache_state;
+    double   cache_time;             /* when cached state was read, ms */
+    int      cache_valid;
+
+    /* Worker thread, started on first command */
+    pthread_t worker;
+    int worker_running;
+    struct cmd_queue queue;
+    int parked;                      /* worker sleeps on park_cond */
+    int free_on_exit;                /* released while worker was running */
+    struct lane* lane;               /* only used by worker, see lane_acquire() */
+    int lane_gen;
+
+    /* Port dwell, only used by worker, see dwell_relay_writes() */
+    double port_switched[UHID_MAX_PORTS]; /* when worker last switched port, ms, 0 if never */
+    uint32_t pending_mask;           /* ports deferred until their dwell is over */
+    uint32_t pending_value;          /* their last requested state */
+    double pending_until;            /* when first of them may be switched, ms */
+    struct relay_cmd* held;          /* writes waiting for pending ports */
+
+    /* Write pacing, only used with io_lock held, see relay_write_interval() */
+    double write_interval;           /* ms between writes, 0 if not paced */
+    double last_write;               /* when last write was sent, ms */
+    double write_times[UHID_MAX_PORTS]; /* ms each report of last write took, see uhid_write_times() */
+    int nwrite_times;
+    int rate_gen;
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_cond;
+};
+
+
+#define HOTPLUG_RETRIES   20   /* udev may need some time to fix permissions */
+#define HOTPLUG_RETRY_MS  50
+#define HOTPLUG_PENDING   16
+
+struct hotplug_probe {
+    char path[256];
+    int  retries;
+};
+
+/*
+ * Relays are kept in slots indexed by relay id, in enumeration order,
+ * and indexed by serial number (case insensitive, duplicates allowed)
+ * and by device path (unique).
+ */
+struct uhid_ctx {
+    pthread_rwlock_t lock;           /* taken for writing to change registry */
+    struct uhid_relay** relays;      /* indexed by id, NULL for free id */
+    int nids;                        /* ids in use are below this */
+    int capacity;
+    int count;
+    struct uhid_relay** by_serial;
+    struct uhid_relay** by_path;
+    unsigned int nbuckets;           /* power of 2 */
+
+    double cache_ttl;
+    double coalesce;
+    double dwell_on;                 /* min time port stays ON, ms */
+    double dwell_off;                /* min time port stays OFF, ms */
+    uhid_event_cb event_cb;
+    void* event_user;
+
+    int monitor_fd;
+    struct hotplug_probe pending[HOTPLUG_PENDING];
+    int pending_count;
+
+    /* Completed asynchronous ops without callback, see uhid_reap() */
+    pthread_mutex_t done_lock;
+    struct uhid_op* done_head;
+    struct uhid_op** done_tail;
+    int done_fd[2];                  /* eventfd (both same) or pipe */
+
+    /* Scheduling lanes and write pacing, see uhid_set_lanes() and uhid_set_rate() */
+    pthread_mutex_t sched_lock;
+    struct lane* lanes;
+    int lane_mode;                   /* UHID_LANES_xxx */
+    int lane_width;                  /* batches running at once in one lane */
+    int lane_gen;                    /* changed with lanes, relays look up their lane again */
+    struct rate_rule* rates;
+    int nrates;
+    int rate_gen;                    /* changed with rates, relays look up their rate again */
+
+    /* Fleet writes, see uring_relay_writes() */
+    pthread_mutex_t ring_lock;
+    struct uring* ring;              /* created on first use */
+    int ring_failed;                 /* io_uring is not available */
+
+    unsigned long allocs;            /* see ctx_alloc() */
+};
+
+
+/* hidapi has global state of its own, keep it initialized while in use */
+static pthread_mutex_t hid_users_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hid_users = 0;
+
+
+/* cross-platform sleep function */
+
+static void sleep_ms(double milliseconds)
+{
+#if defined(_WIN32)
+    Sleep(milliseconds);
+#else
+    struct timespec ts;
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = (milliseconds - ts.tv_sec * 1000.0) * 1000000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+#endif
+}
+
+
+/* cross-platform monotonic clock, in milliseconds */
+
+static double now_ms(void)
+{
+#if defined(_WIN32)
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+
+static void notify(struct uhid_ctx* ctx, int event, const char* serial, const char* path)
+{
+    if (ctx->event_cb)
+        ctx->event_cb(ctx->event_user, event, serial, path);
+}
+
+
+/*
+ * Allocate or resize memory.  Every allocation this library makes after
+ * context is created goes through here and is counted by uhid_alloc_count().
+ * Allocations inside hidapi or libusb are not counted.
+ */
+
+static void* ctx_alloc(struct uhid_ctx* ctx, void* ptr, size_t size)
+{
+    __atomic_add_fetch(&ctx->allocs, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+
+unsigned long uhid_alloc_count(struct uhid_ctx* ctx)
+{
+    return __atomic_load_n(&ctx->allocs, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * FNV-1a hash of string, optionally case insensitive.
+ */
+
+static unsigned int hash_string(const char* str, int nocase)
+{
+    unsigned int h = 2166136261U;
+    for (; *str; str++) {
+        h ^= (unsigned char)(nocase ? tolower((unsigned char)*str) : *str);
+        h *= 16777619U;
+    }
+    return h;
+}
+
+
+static void link_serial(struct uhid_ctx* ctx, struct uhid_relay* relay)
+{
+    unsigned int h = hash_string(relay->serial, 1) & (ctx->nbuckets - 1);
+    relay->serial_next = ctx->by_serial[h];
+    ctx->by_serial[h] = relay;
+}
+
+
+static void unlink_serial(struct uhid_ctx* ctx, struct uhid_relay* relay)
+{
+    struct uhid_relay** link;
+    link = &ctx->by_serial[hash_string(relay->serial, 1) & (ctx->nbuckets - 1)];
+    while (*link != relay)
+        link = &(*link)->serial_next;
+    *link = relay->serial_next;
+}
+
+
+static void link_path(struct uhid_ctx* ctx, struct uhid_relay* relay)
+{
+    unsigned int h = hash_string(relay->path, 0) & (ctx->nbuckets - 1);
+    relay->path_next = ctx->by_path[h];
+    ctx->by_path[h] = relay;
+}
+
+
+static void unlink_path(struct uhid_ctx* ctx, struct uhid_relay* relay)
+{
+    struct uhid_relay** link;
+    link = &ctx->by_path[hash_string(relay->path, 0) & (ctx->nbuckets - 1)];
+    while (*link != relay)
+        link = &(*link)->path_next;
+    *link = relay->path_next;
+}
+
+
+/*
+ * Rebuild hash indexes for new bucket count.
+ * Returns 0 on success, -1 if out of memory.
+ */
+
+static int registry_rehash(struct uhid_ctx* ctx, unsigned int nbuckets)
+{
+    struct uhid_relay** by_serial = ctx_alloc(ctx, NULL, nbuckets * sizeof(*by_serial));
+    struct uhid_relay** by_path   = ctx_alloc(ctx, NULL, nbuckets * sizeof(*by_path));
+    int i;
+    if (!by_serial || !by_path) {
+        free(by_serial);
+        free(by_path);
+        return -1;
+    }
+    memset(by_serial, 0, nbuckets * sizeof(*by_serial));
+    memset(by_path, 0, nbuckets * sizeof(*by_path));
+    free(ctx->by_serial);
+    free(ctx->by_path);
+    ctx->by_serial = by_serial;
+    ctx->by_path   = by_path;
+    ctx->nbuckets  = nbuckets;
+    for (i = 0; i < ctx->nids; i++) {
+        if (ctx->relays[i]) {
+            link_serial(ctx, ctx->relays[i]);
+            link_path(ctx, ctx->relays[i]);
+        }
+    }
+    return 0;
+}
+
+
+static void relay_stop_worker(struct uhid_relay* relay);
+#if defined(HAVE_IO_URING)
+static void uring_free(struct uring* ring);
+#endif
+
+/*
+ * Stop relay worker, close relay device and free relay.
+ */
+
+static void relay_free(struct uhid_relay* relay)
+{
+    if (relay->worker_running && pthread_equal(pthread_self(), relay->worker)) {
+        /* Last reference dropped by completion callback, worker frees relay on exit */
+        pthread_detach(relay->worker);
+        relay->worker_running = 0;
+        relay->free_on_exit = 1;
+        return;
+    }
+    if (relay->worker_running)
+        relay_stop_worker(relay);
+    if (relay->handle)
+        hid_close(relay->handle);
+#if !defined(_WIN32)
+    if (relay->hidraw_fd >= 0)
+        close(relay->hidraw_fd);
+#endif
+    pthread_mutex_destroy(&relay->io_lock);
+    pthread_mutex_destroy(&relay->park_lock);
+    pthread_cond_destroy(&relay->park_cond);
+    free(relay);
+}
+
+
+struct uhid_relay* uhid_ref(struct uhid_relay* relay)
+{
+    __atomic_add_fetch(&relay->refs, 1, __ATOMIC_RELAXED);
+    return relay;
+}
+
+
+void uhid_close(struct uhid_relay* relay)
+{
+    if (relay && __atomic_sub_fetch(&relay->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        relay_free(relay);
+}
+
+
+/*
+ * Add new relay to registry, taking ownership of open device handle.
+ * Must be called with ctx->lock held for writing.
+ * Returns pointer to registered relay, or NULL if out of memory.
+ */
+
+static struct uhid_relay* registry_add(struct uhid_ctx* ctx, const char* serial, int nports,
+                                       const char* path, hid_device* handle)
+{
+    struct uhid_relay* relay;
+    int id;
+
+    /* Reuse lowest free id, so ids stay dense */
+    for (id = 0; id < ctx->nids && ctx->relays[id]; id++)
+        ;
+    if (id == ctx->capacity) {
+        int capacity = ctx->capacity ? ctx->capacity * 2 : 16;
+        struct uhid_relay** relays = ctx_alloc(ctx, ctx->relays, capacity * sizeof(*relays));
+        if (!relays)
+            return NULL;
+        ctx->relays = relays;
+        ctx->capacity = capacity;
+    }
+    /* Keep load factor under 1/2 */
+    if ((unsigned int)(ctx->count + 1) * 2 > ctx->nbuckets) {
+        if (registry_rehash(ctx, ctx->nbuckets ? ctx->nbuckets * 2 : 32) < 0)
+            return NULL;
+    }
+    relay = ctx_alloc(ctx, NULL, sizeof(*relay));
+    if (!relay)
+        return NULL;
+    memset(relay, 0, sizeof(*relay));
+    relay->ctx = ctx;
+    strncpy(relay->serial, serial, sizeof(relay->serial) - 1);
+    strncpy(relay->path, path, sizeof(relay->path) - 1);
+    relay->nports = nports;
+    relay->handle = handle;
+    relay->hidraw_fd = -1;
+#if defined(HAVE_IO_URING)
+    /* hidraw output reports are plain writes, which fleet writes batch */
+    if (!strncmp(path, "/dev/hidraw", 11))
+        relay->hidraw_fd = open(path, O_WRONLY | O_CLOEXEC);
+#endif
+    relay->refs = 1;
+    relay->seen = 1;
+    relay->queue.head = &relay->queue.stub;
+    relay->queue.tail = &relay->queue.stub;
+    pthread_mutex_init(&relay->io_lock, NULL);
+    pthread_mutex_init(&relay->park_lock, NULL);
+    pthread_cond_init(&relay->park_cond, NULL);
+    relay->id = id;
+    ctx->relays[id] = relay;
+    if (id == ctx->nids)
+        ctx->nids++;
+    ctx->count++;
+    link_serial(ctx, relay);
+    link_path(ctx, relay);
+    return relay;
+}
+
+
+/*
+ * Remove relay from registry and drop registry reference to it.
+ * Must be called with ctx->lock held for writing.
+ */
+
+static void registry_remove(struct uhid_ctx* ctx, struct uhid_relay* relay)
+{
+    unlink_serial(ctx, relay);
+    unlink_path(ctx, relay);
+    ctx->relays[relay->id] = NULL;
+    while (ctx->nids > 0 && !ctx->relays[ctx->nids - 1])
+        ctx->nids--;
+    ctx->count--;
+    uhid_close(relay);
+}
+
+
+static struct uhid_relay* registry_find_path(struct uhid_ctx* ctx, const char* path)
+{
+    struct uhid_relay* relay;
+    if (!ctx->nbuckets)
+        return NULL;
+    relay = ctx->by_path[hash_string(path, 0) & (ctx->nbuckets - 1)];
+    for (; relay; relay = relay->path_next) {
+        if (!strcmp(relay->path, path))
+            return relay;
+    }
+    return NULL;
+}
+
+
+struct uhid_ctx* uhid_new(void)
+{
+    struct uhid_ctx* ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+    pthread_mutex_lock(&hid_users_lock);
+    if (hid_users == 0 && hid_init() < 0) {
+        pthread_mutex_unlock(&hid_users_lock);
+        free(ctx);
+        errno = EIO;
+        return NULL;
+    }
+    hid_users++;
+    pthread_mutex_unlock(&hid_users_lock);
+    pthread_rwlock_init(&ctx->lock, NULL);
+    pthread_mutex_init(&ctx->done_lock, NULL);
+    pthread_mutex_init(&ctx->sched_lock, NULL);
+    pthread_mutex_init(&ctx->ring_lock, NULL);
+    ctx->lane_width = 1;
+    ctx->done_tail = &ctx->done_head;
+    ctx->done_fd[0] = ctx->done_fd[1] = -1;
+    ctx->monitor_fd = -1;
+    return ctx;
+}
+
+
+void uhid_free(struct uhid_ctx* ctx)
+{
+    int i;
+    if (!ctx)
+        return;
+    uhid_monitor_stop(ctx);
+    for (i = 0; i < ctx->nids; i++) {
+        if (ctx->relays[i])
+            uhid_close(ctx->relays[i]);
+    }
+    free(ctx->relays);
+    free(ctx->by_serial);
+    free(ctx->by_path);
+    free(ctx->rates);
+    while (ctx->lanes) {
+        struct lane* lane = ctx->lanes;
+        ctx->lanes = lane->next;
+        pthread_cond_destroy(&lane->cond);
+        free(lane);
+    }
+    pthread_rwlock_destroy(&ctx->lock);
+    pthread_mutex_destroy(&ctx->done_lock);
+    pthread_mutex_destroy(&ctx->sched_lock);
+    pthread_mutex_destroy(&ctx->ring_lock);
+#if defined(HAVE_IO_URING)
+    uring_free(ctx->ring);
+#endif
+#if !defined(_WIN32)
+    if (ctx->done_fd[0] >= 0)
+        close(ctx->done_fd[0]);
+    if (ctx->done_fd[1] != ctx->done_fd[0])
+        close(ctx->done_fd[1]);
+#endif
+    free(ctx);
+    pthread_mutex_lock(&hid_users_lock);
+    if (--hid_users == 0)
+        hid_exit();
+    pthread_mutex_unlock(&hid_users_lock);
+}
+
+
+void uhid_set_cache_ttl(struct uhid_ctx* ctx, double ms)
+{
+    ctx->cache_ttl = ms;
+}
+
+
+void uhid_set_coalesce(struct uhid_ctx* ctx, double ms)
+{
+    ctx->coalesce = ms;
+}
+
+
+void uhid_set_dwell(struct uhid_ctx* ctx, double on_ms, double off_ms)
+{
+    ctx->dwell_on = on_ms;
+    ctx->dwell_off = off_ms;
+}
+
+
+int uhid_set_rate(struct uhid_ctx* ctx, const char* key, double rate)
+{
+    struct rate_rule* rates;
+    int rc = 0;
+    int i;
+
+    if (strlen(key) >= sizeof(rates->key) || rate < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&ctx->sched_lock);
+    for (i = 0; i < ctx->nrates && strcasecmp(ctx->rates[i].key, key); i++)
+        ;
+    if (rate == 0) {
+        if (i < ctx->nrates)
+            ctx->rates[i] = ctx->rates[--ctx->nrates];
+    } else {
+        if (i == ctx->nrates) {
+            rates = ctx_alloc(ctx, ctx->rates, (ctx->nrates + 1) * sizeof(*rates));
+            if (rates) {
+                ctx->rates = rates;
+                strcpy(ctx->rates[ctx->nrates++].key, key);
+            } else {
+                rc = -1;
+            }
+        }
+        if (rc == 0)
+            ctx->rates[i].interval = 1000.0 / rate;
+    }
+    ctx->rate_gen++;
+    pthread_mutex_unlock(&ctx->sched_lock);
+    return rc;
+}
+
+
+void uhid_set_lanes(struct uhid_ctx* ctx, int lanes, int width)
+{
+    struct lane* lane;
+    pthread_mutex_lock(&ctx->sched_lock);
+    ctx->lane_mode = (lanes == UHID_LANES_BUS || lanes == UHID_LANES_HUB) ? lanes : UHID_LANES_NONE;
+    ctx->lane_width = width > 0 ? width : 1;
+    ctx->lane_gen++;
+    /* Waiters may fit into wider lanes now */
+    for (lane = ctx->lanes; lane; lane = lane->next) {
+        pthread_cond_broadcast(&lane->cond);
+    }
+    pthread_mutex_unlock(&ctx->sched_lock);
+}
+
+
+void uhid_set_event_cb(struct uhid_ctx* ctx, uhid_event_cb cb, void* user)
+{
+    ctx->event_cb = cb;
+    ctx->event_user = user;
+}
+
+
+/*
+ * Get number of relay ports from USB product string, e.g. USBRelay8.
+ * Returns 0 if this is not a relay, -1 if it has too many ports.
+ */
+
+static int relay_nports(const wchar_t* product)
+{
+    int nports;
+    if (product == NULL)
+        return 0;
+    if (wcslen(product) < 8)
+        return 0;
+    if (wcsncmp(product, L"USBRelay", 7))
+        return 0;
+    nports = wcstol(product+8, 0, 0);
+    if (nports <= 0)
+        return 0;
+    if (nports > UHID_MAX_PORTS)
+        return -1;
+    return nports;
+}
+
+
+/*
+ * Open relay device, read its serial number and add it to registry.
+ * If nports is 0, it is taken from device product string.
+ * Must be called with ctx->lock held for writing.
+ * Returns 1 if relay was added, 0 if device is not a relay,
+ * or -1 if device could not be opened.
+ */
+
+static int probe_relay(struct uhid_ctx* ctx, const char* path, int nports)
+{
+    hid_device *handle;
+    unsigned char buf[RELAY_REPORT_SIZE];
+    char serial[UHID_SERIAL_LEN + 1];
+    int rc;
+
+    handle = hid_open_path(path);
+    if (!handle)
+        return -1;
+    if (nports == 0) {
+        wchar_t product[64];
+        if (hid_get_product_string(handle, product, sizeof(product) / sizeof(product[0])) == 0)
+            nports = relay_nports(product);
+        if (nports <= 0) {
+            hid_close(handle);
+            if (nports < 0)
+                notify(ctx, UHID_EVENT_UNSUPPORTED, NULL, path);
+            return 0;
+        }
+    }
+
+    buf[0] = 1;
+    rc = hid_get_feature_report(handle, buf, sizeof(buf));
+    if (rc == -1) {
+        hid_close(handle);
+        return 0;
+    }
+    memcpy(serial, buf, UHID_SERIAL_LEN);
+    serial[UHID_SERIAL_LEN] = 0;
+    if (!registry_add(ctx, serial, nports, path, handle)) {
+        hid_close(handle);
+        return 0;
+    }
+    notify(ctx, UHID_EVENT_ADDED, serial, path);
+    return 1;
+}
+
+
+int uhid_enumerate(struct uhid_ctx* ctx)
+{
+    struct hid_device_info *devs, *cur_dev;
+    struct uhid_relay* relay;
+    int nports;
+    int count;
+    int i;
+
+    pthread_rwlock_wrlock(&ctx->lock);
+    for (i = 0; i < ctx->nids; i++) {
+        if (ctx->relays[i])
+            ctx->relays[i]->seen = 0;
+    }
+    devs = hid_enumerate(0, 0);
+    for (cur_dev = devs; cur_dev; cur_dev = cur_dev->next) {
+        nports = relay_nports(cur_dev->product_string);
+        if (nports < 0)
+            notify(ctx, UHID_EVENT_UNSUPPORTED, NULL, cur_dev->path);
+        if (nports <= 0)
+            continue;
+        relay = registry_find_path(ctx, cur_dev->path);
+        if (relay) {
+            relay->seen = 1;
+            continue;
+        }
+        if (probe_relay(ctx, cur_dev->path, nports) < 0)
+            notify(ctx, UHID_EVENT_OPEN_FAILED, NULL, cur_dev->path);
+    }
+    hid_free_enumeration(devs);
+    for (i = 0; i < ctx->nids; i++) {
+        relay = ctx->relays[i];
+        if (relay && !relay->seen) {
+            notify(ctx, UHID_EVENT_REMOVED, relay->serial, relay->path);
+            registry_remove(ctx, relay);
+        }
+    }
+    count = ctx->count;
+    pthread_rwlock_unlock(&ctx->lock);
+    return count;
+}
+
+
+int uhid_list(struct uhid_ctx* ctx, struct uhid_relay** relays, int max)
+{
+    int count = 0;
+    int i;
+    pthread_rwlock_rdlock(&ctx->lock);
+    for (i = 0; i < ctx->nids; i++) {
+        if (!ctx->relays[i])
+            continue;
+        if (count < max)
+            relays[count] = uhid_ref(ctx->relays[i]);
+        count++;
+    }
+    pthread_rwlock_unlock(&ctx->lock);
+    return count;
+}
+
+
+int uhid_find(struct uhid_ctx* ctx, const char* serial, struct uhid_relay** relays, int max)
+{
+    struct uhid_relay* relay;
+    int count = 0;
+    pthread_rwlock_rdlock(&ctx->lock);
+    if (ctx->nbuckets) {
+        relay = ctx->by_serial[hash_string(serial, 1) & (ctx->nbuckets - 1)];
+        for (; relay; relay = relay->serial_next) {
+            if (strcasecmp(relay->serial, serial))
+                continue;
+            if (count < max)
+                relays[count] = uhid_ref(relay);
+            count++;
+        }
+    }
+    pthread_rwlock_unlock(&ctx->lock);
+    return count;
+}
+
+
+struct uhid_relay* uhid_open(struct uhid_ctx* ctx, const char* serial)
+{
+    struct uhid_relay* relay = NULL;
+    int count = uhid_find(ctx, serial, &relay, 1);
+    if (count == 1)
+        return relay;
+    uhid_close(relay);
+    errno = count ? EEXIST : ENOENT;
+    return NULL;
+}
+
+
+struct uhid_relay* uhid_open_path(struct uhid_ctx* ctx, const char* path)
+{
+    struct uhid_relay* relay;
+    pthread_rwlock_rdlock(&ctx->lock);
+    relay = registry_find_path(ctx, path);
+    if (relay)
+        uhid_ref(relay);
+    pthread_rwlock_unlock(&ctx->lock);
+    if (!relay)
+        errno = ENOENT;
+    return relay;
+}
+
+
+const char* uhid_relay_serial(const struct uhid_relay* relay)
+{
+    return relay->serial;
+}
+
+
+const char* uhid_relay_path(const struct uhid_relay* relay)
+{
+    return relay->path;
+}
+
+
+int uhid_relay_nports(const struct uhid_relay* relay)
+{
+    return relay->nports;
+}
+
+
+int uhid_write_times(struct uhid_relay* relay, double* times, int max)
+{
+    int n;
+    pthread_mutex_lock(&relay->io_lock);
+    n = relay->nwrite_times < max ? relay->nwrite_times : max;
+    memcpy(times, relay->write_times, n * sizeof(*times));
+    pthread_mutex_unlock(&relay->io_lock);
+    return n;
+}
+
+
+int uhid_relay_id(const struct uhid_relay* relay)
+{
+    return relay->id;
+}
+
+
+int uhid_max_id(struct uhid_ctx* ctx)
+{
+    int nids;
+    pthread_rwlock_rdlock(&ctx->lock);
+    nids = ctx->nids;
+    pthread_rwlock_unlock(&ctx->lock);
+    return nids;
+}
+
+
+/*
+ * Physical location.
+ * Location is USB port chain as named by sysfs, e.g. 1-1.2 is
+ * port 2 of hub on port 1 of bus 1.  It is resolved from sysfs
+ * and device paths alone, no device is opened to find it.
+ */
+
+#if defined(__linux__)
+
+static int valid_location(const char* location)
+{
+    const char* p;
+    if (!isdigit((unsigned char)location[0]) || !strchr(location, '-'))
+        return 0;
+    for (p = location; *p; p++) {
+        if (!isdigit((unsigned char)*p) && *p != '-' && *p != '.')
+            return 0;
+    }
+    return p - location < 64;
+}
+
+
+/* Read integer sysfs attribute, returns -1 if it is not there */
+
+static int sysfs_read_int(const char* dir, const char* name, int base)
+{
+    char path[PATH_MAX];
+    char buf[32];
+    FILE* f;
+    int value = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fgets(buf, sizeof(buf), f))
+        value = (int)strtol(buf, NULL, base);
+    fclose(f);
+    return value;
+}
+
+
+/* Find hidraw node under USB interface directory, e.g. 0003:16C0:05DF.0001/hidraw/hidraw3 */
+
+static int interface_hidraw(const char* dir, char* node, size_t size)
+{
+    char path[PATH_MAX];
+    struct dirent* hid;
+    struct dirent* ent;
+    DIR* hids;
+    DIR* d;
+    int found = 0;
+    int len;
+
+    hids = opendir(dir);
+    if (!hids)
+        return 0;
+    while (!found && (hid = readdir(hids)) != NULL) {
+        if (hid->d_name[0] == '.')
+            continue;
+        /* skip entries whose path doesn't fit */
+        len = snprintf(path, sizeof(path), "%s/%s/hidraw", dir, hid->d_name);
+        if (len < 0 || (size_t)len >= sizeof(path))
+            continue;
+        d = opendir(path);
+        if (!d)
+            continue;
+        while ((ent = readdir(d)) != NULL) {
+            if (!strncmp(ent->d_name, "hidraw", 6)) {
+                len = snprintf(node, size, "/dev/%s", ent->d_name);
+                if (len < 0 || (size_t)len >= size)
+                    continue;
+                found = 1;
+                break;
+            }
+        }
+        closedir(d);
+    }
+    closedir(hids);
+    return found;
+}
+
+
+/*
+ * Get device paths relay at location may have with any hidapi backend:
+ * /dev/hidrawN (hidraw), 1-1.2:1.0 (libusb) and 0001:0005:00 (old libusb),
+ * one set for every interface.  Returns count of paths.
+ */
+
+static int location_paths(const char* location, char paths[][256], int max)
+{
+    char dir[PATH_MAX / 2];
+    char intf[PATH_MAX];
+    struct dirent* ent;
+    size_t len = strlen(location);
+    int busnum, devnum, ifnum;
+    int n = 0;
+    DIR* d;
+
+    snprintf(dir, sizeof(dir), "%s/bus/usb/devices/%s", UHID_SYSFS, location);
+    busnum = sysfs_read_int(dir, "busnum", 10);
+    devnum = sysfs_read_int(dir, "devnum", 10);
+    d = opendir(dir);
+    if (!d)
+        return 0;
+    while (n + 3 <= max && (ent = readdir(d)) != NULL) {
+        if (strncmp(ent->d_name, location, len) || ent->d_name[len] != ':')
+            continue;
+        snprintf(intf, sizeof(intf), "%s/%s", dir, ent->d_name);
+        if (interface_hidraw(intf, paths[n], sizeof(paths[n])))
+            n++;
+        snprintf(paths[n++], sizeof(paths[0]), "%s", ent->d_name);
+        ifnum = sysfs_read_int(intf, "bInterfaceNumber", 16);
+        if (busnum >= 0 && devnum >= 0 && ifnum >= 0)
+            snprintf(paths[n++], sizeof(paths[0]), "%04x:%04x:%02x", busnum, devnum, ifnum);
+    }
+    closedir(d);
+    return n;
+}
+
+
+int uhid_path_location(const char* path, char* location, int size)
+{
+    char link[PATH_MAX];
+    char real[PATH_MAX];
+    char dir[PATH_MAX / 2];
+    unsigned int bus, dev, intf;
+    struct dirent* ent;
+    const char* colon;
+    char* token;
+    char* save = NULL;
+    int found = 0;
+    DIR* d;
+
+    if (!strncmp(path, "/dev/hidraw", 11)) {
+        /* last USB device on sysfs path of hidraw node */
+        snprintf(link, sizeof(link), "%s/class/hidraw/%s/device", UHID_SYSFS, path + 5);
+        if (realpath(link, real)) {
+            for (token = strtok_r(real, "/", &save); token; token = strtok_r(NULL, "/", &save)) {
+                if (valid_location(token)) {
+                    snprintf(location, size, "%s", token);
+                    found = 1;
+                }
+            }
+        }
+    } else if ((colon = strchr(path, ':')) != NULL && strchr(path, '-') &&
+               strchr(path, '-') < colon) {
+        /* libusb path is location:config.interface */
+        snprintf(location, size, "%.*s", (int)(colon - path), path);
+        found = valid_location(location);
+    } else if (sscanf(path, "%x:%x:%x", &bus, &dev, &intf) == 3) {
+        /* old libusb path is bus:device:interface */
+        snprintf(dir, sizeof(dir), "%s/bus/usb/devices", UHID_SYSFS);
+        d = opendir(dir);
+        while (d && !found && (ent = readdir(d)) != NULL) {
+            if (!valid_location(ent->d_name))
+                continue;
+            snprintf(link, sizeof(link), "%s/%s", dir, ent->d_name);
+            if (sysfs_read_int(link, "busnum", 10) == (int)bus &&
+                sysfs_read_int(link, "devnum", 10) == (int)dev) {
+                snprintf(location, size, "%s", ent->d_name);
+                found = 1;
+            }
+        }
+        if (d)
+            closedir(d);
+    }
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+
+struct uhid_relay* uhid_open_location(struct uhid_ctx* ctx, const char* location)
+{
+    char paths[LOCATION_PATHS][256];
+    struct uhid_relay* relay = NULL;
+    int n;
+    int i;
+
+    if (!valid_location(location)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    n = location_paths(location, paths, LOCATION_PATHS);
+    pthread_rwlock_wrlock(&ctx->lock);
+    /* Relay may be known already, otherwise only this device is probed */
+    for (i = 0; i < n && !relay; i++) {
+        relay = registry_find_path(ctx, paths[i]);
+    }
+    for (i = 0; i < n && !relay; i++) {
+        if (probe_relay(ctx, paths[i], 0) > 0)
+            relay = registry_find_path(ctx, paths[i]);
+    }
+    if (relay)
+        uhid_ref(relay);
+    pthread_rwlock_unlock(&ctx->lock);
+    if (!relay)
+        errno = ENOENT;
+    return relay;
+}
+
+#else
+
+int uhid_path_location(const char* path, char* location, int size)
+{
+    (void)path;
+    (void)location;
+    (void)size;
+    errno = ENOSYS;
+    return -1;
+}
+
+
+struct uhid_relay* uhid_open_location(struct uhid_ctx* ctx, const char* location)
+{
+    (void)ctx;
+    (void)location;
+    errno = ENOSYS;
+    return NULL;
+}
+
+#endif
+
+
+/*
+ * Scheduling lanes.
+ * Relay worker takes slot in lane of its relay for every batch of commands,
+ * so at most lane_width batches run in one lane, while lanes run in parallel.
+ */
+
+static void lane_key(struct uhid_relay* relay, int mode, char* key, size_t size)
+{
+    char location[64];
+    char* end;
+
+    if (uhid_path_location(relay->path, location, sizeof(location)) < 0) {
+        /* topology is not known, relay gets lane of its own */
+        snprintf(key, size, "%s", relay->path);
+        return;
+    }
+    /* hub is location without last port, bus is location up to '-' */
+    end = (mode == UHID_LANES_HUB) ? strrchr(location, '.') : NULL;
+    if (!end)
+        end = strchr(location, '-');
+    *end = 0;
+    snprintf(key, size, "%s", location);
+}
+
+
+/*
+ * Wait for free slot in lane of relay.
+ * Returns lane to release with lane_release(), or NULL if lanes are off.
+ */
+
+static struct lane* lane_acquire(struct uhid_relay* relay)
+{
+    struct uhid_ctx* ctx = relay->ctx;
+    struct lane* lane;
+    char key[sizeof(lane->key)];
+    int mode, gen;
+
+    pthread_mutex_lock(&ctx->sched_lock);
+    mode = ctx->lane_mode;
+    gen = ctx->lane_gen;
+    if (mode != UHID_LANES_NONE && (!relay->lane || relay->lane_gen != gen)) {
+        /* sysfs is read without lock */
+        pthread_mutex_unlock(&ctx->sched_lock);
+        lane_key(relay, mode, key, sizeof(key));
+        pthread_mutex_lock(&ctx->sched_lock);
+        for (lane = ctx->lanes; lane && strcmp(lane->key, key); lane = lane->next)
+            ;
+        if (!lane) {
+            lane = ctx_alloc(ctx, NULL, sizeof(*lane));
+            if (lane) {
+                memset(lane, 0, sizeof(*lane));
+                strcpy(lane->key, key);
+                pthread_cond_init(&lane->cond, NULL);
+                lane->next = ctx->lanes;
+                ctx->lanes = lane;
+            }
+        }
+        relay->lane = lane;
+        relay->lane_gen = gen;
+    }
+    lane = (mode != UHID_LANES_NONE) ? relay->lane : NULL;
+    if (lane) {
+        while (lane->active >= ctx->lane_width)
+            pthread_cond_wait(&lane->cond, &ctx->sched_lock);
+        lane->active++;
+    }
+    pthread_mutex_unlock(&ctx->sched_lock);
+    return lane;
+}
+
+
+static void lane_release(struct uhid_ctx* ctx, struct lane* lane)
+{
+    if (!lane)
+        return;
+    pthread_mutex_lock(&ctx->sched_lock);
+    lane->active--;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&ctx->sched_lock);
+}
+
+
+/*
+ * Bitmask of all ports present on relay.
+ */
+
+static uint32_t relay_port_mask(const struct uhid_relay* relay)
+{
+    if (relay->nports >= UHID_MAX_PORTS)
+        return UHID_ALL_PORTS;
+    return UHID_PORT_BIT(relay->nports + 1) - 1;
+}
+
+
+/*
+ * Read state of all relay ports with single feature report.
+ * Must be called with io_lock held.
+ * Returns 0 and fills state bitmap on success, -1 if error occured.
+ */
+
+static int read_relay_state(struct uhid_relay* relay, uint32_t* state)
+{
+    int rc;
+    int i;
+    unsigned char buf[RELAY_REPORT_SIZE] = { 1 };
+
+    rc = hid_get_feature_report(relay->handle, buf, sizeof(buf));
+    if (rc < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    *state = 0;
+    for (i = 0; i < (relay->nports + 7) / 8 && RELAY_STATE_OFFSET + i < rc; i++) {
+        *state |= (uint32_t)buf[RELAY_STATE_OFFSET + i] << (8 * i);
+    }
+    *state &= relay_port_mask(relay);
+    return 0;
+}
+
+
+struct relay_write {
+    unsigned char opcode;
+    unsigned char port;
+};
+
+/*
+ * Plan output reports to move relay from current to target state.
+ * Ports already in requested state are skipped, and all-on/all-off
+ * opcodes replace per-port writes when they reach target in one report.
+ * Bulk opcodes are never used if they would glitch unaffected ports,
+ * or if current state is not known: then caller passes current with
+ * every requested port flipped, so each of them gets its own write.
+ * Returns number of writes stored in plan[] (at most UHID_MAX_PORTS).
+ */
+
+static int plan_relay_writes(const struct uhid_relay* relay, uint32_t current, uint32_t target,
+                             int known, struct relay_write* plan)
+{
+    uint32_t all = relay_port_mask(relay);
+    uint32_t changed = (current ^ target) & all;
+    int n = 0;
+    int port;
+
+    if (changed == 0)
+        return 0;
+    if (known && (changed & (changed - 1)) != 0 &&
+        ((target & all) == all || (target & all) == 0)) {
+        plan[0].opcode = (target & all) ? RELAY_CMD_ALL_ON : RELAY_CMD_ALL_OFF;
+        plan[0].port = 0;
+        return 1;
+    }
+    for (port = 1; port <= relay->nports; port++) {
+        if (changed & UHID_PORT_BIT(port)) {
+            plan[n].opcode = (target & UHID_PORT_BIT(port)) ? RELAY_CMD_ON : RELAY_CMD_OFF;
+            plan[n].port = port;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+/*
+ * Read relay state and plan writes to set ports given by portmask
+ * to state given by bits of value.  Relay state after writes is
+ * stored in target, if known is set; if state could not be read,
+ * every port in portmask is written and state of others is unknown.
+ * Must be called with io_lock held.
+ * Returns number of writes stored in plan[].
+ */
+
+static int prepare_relay_writes(struct uhid_relay* relay, uint32_t portmask, uint32_t value,
+                                struct relay_write* plan, uint32_t* target, int* known)
+{
+    uint32_t current;
+    portmask &= relay_port_mask(relay);
+    *known = (read_relay_state(relay, &current) == 0);
+    if (!*known)
+        current = ~value & portmask;
+    *target = (current & ~portmask) | (value & portmask);
+    relay->cache_valid = 0;
+    return plan_relay_writes(relay, current, *target, *known, plan);
+}
+
+
+/*
+ * Same as prepare_relay_writes(), but ports which worker switched less than
+ * dwell time ago are not written: their requested state becomes pending
+ * (replacing older pending state of relay), to be written when dwell is over.
+ * Ports already in requested state are never pending, so burst of toggles
+ * collapses to at most one switch.  Ports to be switched are stored in switched.
+ * Must be called by worker with io_lock held.
+ */
+
+static int dwell_relay_writes(struct uhid_relay* relay, uint32_t portmask, uint32_t value,
+                              struct relay_write* plan, uint32_t* target, uint32_t* switched,
+                              int* known)
+{
+    struct uhid_ctx* ctx = relay->ctx;
+    double now = now_ms();
+    double until;
+    uint32_t current;
+    uint32_t bit;
+    int port;
+
+    portmask &= relay_port_mask(relay);
+    *known = (read_relay_state(relay, &current) == 0);
+    if (!*known)
+        current = ~value & portmask;
+    relay->pending_mask = 0;
+    for (port = 1; port <= relay->nports; port++) {
+        bit = UHID_PORT_BIT(port);
+        if (!((current ^ value) & portmask & bit) || relay->port_switched[port - 1] == 0)
+            continue;
+        until = relay->port_switched[port - 1] + ((current & bit) ? ctx->dwell_on : ctx->dwell_off);
+        if (until > now) {
+            if (!relay->pending_mask || until < relay->pending_until)
+                relay->pending_until = until;
+            relay->pending_mask |= bit;
+        }
+    }
+    relay->pending_value = value & relay->pending_mask;
+    portmask &= ~relay->pending_mask;
+    *target = (current & ~portmask) | (value & portmask);
+    *switched = current ^ *target;
+    relay->cache_valid = 0;
+    return plan_relay_writes(relay, current, *target, *known, plan);
+}
+
+
+/*
+ * Get time between writes to relay, from rule for its serial number,
+ * or for its model.  Must be called with io_lock held.
+ */
+
+static double relay_write_interval(struct uhid_relay* relay)
+{
+    struct uhid_ctx* ctx = relay->ctx;
+    char model[16];
+    int i;
+
+    if (relay->rate_gen == __atomic_load_n(&ctx->rate_gen, __ATOMIC_ACQUIRE))
+        return relay->write_interval;
+    snprintf(model, sizeof(model), "USBRelay%d", relay->nports);
+    pthread_mutex_lock(&ctx->sched_lock);
+    relay->write_interval = 0;
+    for (i = 0; i < ctx->nrates; i++) {
+        if (!strcasecmp(ctx->rates[i].key, relay->serial)) {
+            relay->write_interval = ctx->rates[i].interval;
+            break;
+        }
+        if (!strcasecmp(ctx->rates[i].key, model))
+            relay->write_interval = ctx->rates[i].interval;
+    }
+    relay->rate_gen = ctx->rate_gen;
+    pthread_mutex_unlock(&ctx->sched_lock);
+    return relay->write_interval;
+}
+
+
+/*
+ * Send planned output reports to relay, paced by its write rate.
+ * Must be called with io_lock held.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int issue_relay_writes(struct uhid_relay* relay, const struct relay_write* plan, int n)
+{
+    double interval = n > 0 ? relay_write_interval(relay) : 0;
+    double wait;
+    double started;
+    int i;
+    relay->nwrite_times = 0;
+    for (i = 0; i < n; i++) {
+        unsigned char buf[9] = {0, plan[i].opcode, plan[i].port};
+        if (interval > 0) {
+            wait = relay->last_write + interval - now_ms();
+            if (wait > 0)
+                sleep_ms(wait);
+        }
+        started = now_ms();
+        if (hid_write(relay->handle, buf, sizeof(buf)) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        relay->last_write = now_ms();
+        relay->write_times[relay->nwrite_times++] = relay->last_write - started;
+    }
+    return 0;
+}
+
+
+/*
+ * Write new serial number and read it back to verify.
+ * Must be called with io_lock held.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int write_relay_serial(struct uhid_relay* relay, const char* serial)
+{
+    unsigned char cmd[9];
+    unsigned char buf[RELAY_REPORT_SIZE] = { 1 };
+
+    /* serial is at most UHID_SERIAL_LEN long, see uhid_set_serials() */
+    memset(cmd, 0, sizeof(cmd));
+    cmd[1] = RELAY_CMD_SERIAL;
+    memcpy(cmd + 2, serial, strlen(serial));
+    if (hid_write(relay->handle, cmd, sizeof(cmd)) < 0)
+        return -1;
+    if (hid_get_feature_report(relay->handle, buf, sizeof(buf)) < UHID_SERIAL_LEN)
+        return -1;
+    return memcmp(buf, cmd+2, UHID_SERIAL_LEN) ? -1 : 0;
+}
+
+
+/*
+ * Relay worker threads.
+ * Every relay has its own worker thread, which is fed through lock-free
+ * queue.  Callers only queue commands and wait for their completion,
+ * so slow or hung relay never delays other relays.
+ */
+
+static void queue_push(struct cmd_queue* q, struct relay_cmd* cmd)
+{
+    struct relay_cmd* prev;
+    __atomic_store_n(&cmd->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->head, cmd, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, cmd, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Pop command from queue, consumer only.
+ * Returns NULL if queue is empty, or if producer is still in the middle
+ * of push (queue_empty() is false then, try again).
+ */
+
+static struct relay_cmd* queue_pop(struct cmd_queue* q)
+{
+    struct relay_cmd* tail = q->tail;
+    struct relay_cmd* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &q->stub) {
+        if (!next)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_SEQ_CST))
+        return NULL;
+    queue_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+static int queue_empty(struct cmd_queue* q)
+{
+    return q->tail == &q->stub && __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == &q->stub;
+}
+
+
+static void completion_push(struct uhid_ctx* ctx, struct uhid_op* op);
+
+static void relay_complete(struct relay_cmd* cmd, int rc, uint32_t result)
+{
+    if (cmd->async) {
+        struct uhid_op* op = (struct uhid_op*)cmd;
+        cmd->rc = rc;
+        cmd->result = result;
+        __atomic_store_n(&cmd->done, 1, __ATOMIC_RELEASE);
+        if (op->cb)
+            op->cb(op, op->user);
+        else
+            completion_push(op->relay->ctx, op);
+        return;
+    }
+    pthread_mutex_lock(&cmd->lock);
+    cmd->rc = rc;
+    cmd->result = result;
+    cmd->done = 1;
+    pthread_cond_signal(&cmd->cond);
+    pthread_mutex_unlock(&cmd->lock);
+}
+
+
+/* Absolute deadline ms from now, for pthread_cond_timedwait() */
+
+static void deadline_after(double ms, struct timespec* ts)
+{
+#if defined(_WIN32)
+    FILETIME ft;
+    ULARGE_INTEGER t;
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    t.QuadPart -= 116444736000000000ULL; /* 100ns units since 1601 */
+    ts->tv_sec = t.QuadPart / 10000000;
+    ts->tv_nsec = (t.QuadPart % 10000000) * 100;
+#else
+    clock_gettime(CLOCK_REALTIME, ts);
+#endif
+    ts->tv_sec += (time_t)(ms / 1000);
+    ts->tv_nsec += (long)((ms - (time_t)(ms / 1000) * 1000.0) * 1000000);
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+
+/*
+ * Pop all queued commands, appending them to list in arrival order.
+ * If wait is set, sleep until at least one command arrives,
+ * or until time given by until (ms, 0 for no limit) comes.
+ */
+
+static void relay_drain(struct uhid_relay* relay, struct relay_cmd*** tail, int wait, double until)
+{
+    struct relay_cmd* cmd;
+    struct timespec ts;
+    double left;
+    for (;;) {
+        while ((cmd = queue_pop(&relay->queue)) != NULL) {
+            cmd->next = NULL;
+            **tail = cmd;
+            *tail = &cmd->next;
+            wait = 0;
+        }
+        if (queue_empty(&relay->queue)) {
+            if (!wait)
+                return;
+            pthread_mutex_lock(&relay->park_lock);
+            __atomic_store_n(&relay->parked, 1, __ATOMIC_SEQ_CST);
+            while (queue_empty(&relay->queue) && wait) {
+                if (until == 0) {
+                    pthread_cond_wait(&relay->park_cond, &relay->park_lock);
+                } else if ((left = until - now_ms()) > 0) {
+                    deadline_after(left, &ts);
+                    pthread_cond_timedwait(&relay->park_cond, &relay->park_lock, &ts);
+                } else {
+                    wait = 0;
+                }
+            }
+            __atomic_store_n(&relay->parked, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&relay->park_lock);
+        } else {
+            sched_yield(); /* producer is halfway through push */
+        }
+    }
+}
+
+
+/*
+ * Relay worker thread.
+ * Every wakeup handles all queued commands together, as one batch in
+ * scheduling lane of relay: writes are merged
+ * into one target bitmap (later write wins for same port) and applied
+ * with one planned write set, and all reads share one feature read,
+ * or none at all if cached state is younger than cache TTL.
+ * With coalescing window, worker waits that long after first write for more.
+ * Writes to ports still in their dwell are held (and complete) until
+ * pending state of those ports is written, see dwell_relay_writes().
+ */
+
+static void* relay_worker(void* arg)
+{
+    struct uhid_relay* relay = arg;
+    struct uhid_ctx* ctx = relay->ctx;
+    struct relay_write plan[UHID_MAX_PORTS];
+    struct relay_cmd* list;
+    struct relay_cmd** tail;
+    struct relay_cmd* cmd;
+    struct relay_cmd* next;
+    struct relay_cmd** link;
+    struct lane* lane;
+    uint32_t mask, value, result, state, switched;
+    int writes, reads, serials, stop;
+    int wrc, rrc, known;
+    int n;
+
+    for (stop = 0; !stop && !relay->free_on_exit; ) {
+        list = NULL;
+        tail = &list;
+        /* pending ports are written when their dwell is over */
+        relay_drain(relay, &tail, 1, relay->pending_mask ? relay->pending_until : 0);
+        writes = 0;
+        for (cmd = list; cmd; cmd = cmd->next) {
+            writes |= cmd->op == RELAY_OP_WRITE;
+        }
+        if (writes && ctx->coalesce > 0) {
+            sleep_ms(ctx->coalesce);
+            relay_drain(relay, &tail, 0, 0);
+        }
+
+        mask = relay->pending_mask;
+        value = relay->pending_value;
+        writes = reads = serials = 0;
+        for (cmd = list; cmd; cmd = cmd->next) {
+            if (cmd->op == RELAY_OP_WRITE) {
+                value = (value & ~cmd->mask) | (cmd->value & cmd->mask);
+                mask |= cmd->mask;
+                writes++;
+            } else if (cmd->op == RELAY_OP_READ) {
+                reads++;
+            } else if (cmd->op == RELAY_OP_SERIAL) {
+                serials++;
+            } else {
+                stop = 1;
+            }
+        }
+        wrc = rrc = 0;
+        result = state = 0;
+        lane = lane_acquire(relay);
+        pthread_mutex_lock(&relay->io_lock);
+        if (writes || mask) {
+            double now;
+            n = dwell_relay_writes(relay, mask, value, plan, &result, &switched, &known);
+            wrc = issue_relay_writes(relay, plan, n);
+            now = now_ms();
+            for (n = 1; n <= relay->nports; n++) {
+                if (switched & UHID_PORT_BIT(n))
+                    relay->port_switched[n - 1] = now;
+            }
+            if (wrc < 0)
+                relay->pending_mask = 0;
+            /* don't report ports of unknown state as off, fail if still unknown */
+            else if (!known)
+                wrc = read_relay_state(relay, &result);
+        }
+        for (cmd = list; serials && cmd; cmd = cmd->next) {
+            if (cmd->op == RELAY_OP_SERIAL)
+                cmd->rc = write_relay_serial(relay, cmd->serial);
+        }
+        if (reads) {
+            if (relay->cache_valid && now_ms() - relay->cache_time < ctx->cache_ttl) {
+                state = relay->cache_state;
+            } else {
+                double started = now_ms();
+                rrc = read_relay_state(relay, &state);
+                relay->cache_valid = (rrc == 0);
+                relay->cache_state = state;
+                relay->cache_time = started;
+            }
+        }
+        pthread_mutex_unlock(&relay->io_lock);
+        lane_release(ctx, lane);
+        for (link = &relay->held; (cmd = *link) != NULL; ) {
+            if (cmd->mask & relay->pending_mask) {
+                link = &cmd->next;
+            } else {
+                *link = cmd->next;
+                relay_complete(cmd, wrc, result);
+            }
+        }
+        for (cmd = list; cmd; cmd = next) {
+            next = cmd->next; /* cmd may be gone once completed */
+            if (cmd->op == RELAY_OP_WRITE && (cmd->mask & relay->pending_mask)) {
+                cmd->next = relay->held;
+                relay->held = cmd;
+            } else if (cmd->op == RELAY_OP_WRITE)
+                relay_complete(cmd, wrc, result);
+            else if (cmd->op == RELAY_OP_SERIAL)
+                relay_complete(cmd, cmd->rc, 0);
+            else
+                relay_complete(cmd, rrc, state);
+        }
+    }
+    while ((cmd = relay->held) != NULL) {
+        relay->held = cmd->next;
+        relay_complete(cmd, -1, 0);
+    }
+    if (relay->free_on_exit)
+        relay_free(relay);
+    return NULL;
+}
+
+
+/*
+ * Queue command to relay worker, starting worker if needed.
+ * Returns 0 on success, -1 if worker could not be started.
+ */
+
+static int relay_submit(struct uhid_relay* relay, struct relay_cmd* cmd)
+{
+    if (!__atomic_load_n(&relay->worker_running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&relay->park_lock);
+        if (!relay->worker_running) {
+            if (pthread_create(&relay->worker, NULL, relay_worker, relay) != 0) {
+                pthread_mutex_unlock(&relay->park_lock);
+                errno = EAGAIN;
+                return -1;
+            }
+            __atomic_store_n(&relay->worker_running, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&relay->park_lock);
+    }
+    if (!cmd->async) {
+        pthread_mutex_init(&cmd->lock, NULL);
+        pthread_cond_init(&cmd->cond, NULL);
+    }
+    cmd->done = 0;
+    queue_push(&relay->queue, cmd);
+    if (__atomic_load_n(&relay->parked, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&relay->park_lock);
+        pthread_cond_signal(&relay->park_cond);
+        pthread_mutex_unlock(&relay->park_lock);
+    }
+    return 0;
+}
+
+
+/*
+ * Wait for command submitted with relay_submit() to complete.
+ * Returns command result code.
+ */
+
+static int relay_wait(struct relay_cmd* cmd)
+{
+    pthread_mutex_lock(&cmd->lock);
+    while (!cmd->done)
+        pthread_cond_wait(&cmd->cond, &cmd->lock);
+    pthread_mutex_unlock(&cmd->lock);
+    pthread_mutex_destroy(&cmd->lock);
+    pthread_cond_destroy(&cmd->cond);
+    if (cmd->rc < 0)
+        errno = EIO;
+    return cmd->rc;
+}
+
+
+/*
+ * Run one command on relay worker and wait for it.
+ * For RELAY_OP_WRITE, ports in mask are set to state given by value.
+ * Relay state after command is stored in result.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int relay_call(struct uhid_relay* relay, int op, uint32_t mask, uint32_t value,
+                      uint32_t* result)
+{
+    struct relay_cmd cmd;
+    cmd.async = 0;
+    cmd.op = op;
+    cmd.mask = mask;
+    cmd.value = value;
+    if (relay_submit(relay, &cmd) < 0)
+        return -1;
+    relay_wait(&cmd);
+    if (result)
+        *result = cmd.result;
+    return cmd.rc;
+}
+
+
+static void relay_stop_worker(struct uhid_relay* relay)
+{
+    relay_call(relay, RELAY_OP_STOP, 0, 0, NULL);
+    pthread_join(relay->worker, NULL);
+    relay->worker_running = 0;
+}
+
+
+int uhid_get_bitmap(struct uhid_relay* relay, uint32_t* bitmap)
+{
+    return relay_call(relay, RELAY_OP_READ, 0, 0, bitmap);
+}
+
+
+int uhid_set_bitmap(struct uhid_relay* relay, uint32_t mask, uint32_t value, uint32_t* result)
+{
+    return relay_call(relay, RELAY_OP_WRITE, mask, value, result);
+}
+
+
+int uhid_cycle(struct uhid_relay* relay, uint32_t mask, double delay, uint32_t* result)
+{
+    if (relay_call(relay, RELAY_OP_WRITE, mask, 0, result) < 0)
+        return -1;
+    sleep_ms(delay * 1000);
+    return relay_call(relay, RELAY_OP_WRITE, mask, mask, result);
+}
+
+
+/* Update registry after relay got new serial number */
+
+static void rename_relay(struct uhid_relay* relay, const char* serial)
+{
+    struct uhid_ctx* ctx = relay->ctx;
+    pthread_rwlock_wrlock(&ctx->lock);
+    if (ctx->relays[relay->id] == relay) {
+        unlink_serial(ctx, relay);
+        strncpy(relay->serial, serial, sizeof(relay->serial) - 1);
+        link_serial(ctx, relay);
+    } else {
+        strncpy(relay->serial, serial, sizeof(relay->serial) - 1);
+    }
+    pthread_rwlock_unlock(&ctx->lock);
+}
+
+
+int uhid_set_serial(struct uhid_relay* relay, const char* serial)
+{
+    return uhid_set_serials(&relay, 1, &serial, NULL);
+}
+
+
+/*
+ * Run one command on every relay worker, all relays in parallel
+ * (in batches of READ_BATCH, commands live on stack), and wait for them.
+ * Relay i gets masks[i] and values[i] if masks is not NULL,
+ * and serials[i] for RELAY_OP_SERIAL.  results[] is optional.
+ */
+
+static int fleet_call(struct uhid_relay** relays, int count, int op, uint32_t mask, uint32_t value,
+                      const uint32_t* masks, const uint32_t* values, const char* const* serials,
+                      uint32_t* results, int* failed)
+{
+    struct relay_cmd cmds[READ_BATCH];
+    int queued[READ_BATCH];
+    int rc = 0;
+    int first;
+    int n;
+    int i;
+
+    for (first = 0; first < count; first += n) {
+        n = count - first < READ_BATCH ? count - first : READ_BATCH;
+        for (i = 0; i < n; i++) {
+            cmds[i].async = 0;
+            cmds[i].op = op;
+            cmds[i].mask = masks ? masks[first + i] : mask;
+            cmds[i].value = masks ? values[first + i] : value;
+            cmds[i].serial = serials ? serials[first + i] : NULL;
+            cmds[i].result = 0;
+            queued[i] = (relay_submit(relays[first + i], &cmds[i]) == 0);
+        }
+        for (i = 0; i < n; i++) {
+            if (queued[i])
+                relay_wait(&cmds[i]);
+            else
+                cmds[i].rc = -1;
+            if (op == RELAY_OP_SERIAL && cmds[i].rc == 0)
+                rename_relay(relays[first + i], serials[first + i]);
+            if (results)
+                results[first + i] = cmds[i].result;
+            if (failed)
+                failed[first + i] = (cmds[i].rc < 0);
+            if (cmds[i].rc < 0)
+                rc = -1;
+        }
+    }
+    if (rc < 0)
+        errno = EIO;
+    return rc;
+}
+
+
+int uhid_set_serials(struct uhid_relay** relays, int count, const char* const* serials, int* failed)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        if (strlen(serials[i]) > UHID_SERIAL_LEN) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return fleet_call(relays, count, RELAY_OP_SERIAL, 0, 0, NULL, NULL, serials, NULL, failed);
+}
+
+
+int uhid_get_bitmaps(struct uhid_relay** relays, int count, uint32_t* bitmaps, int* failed)
+{
+    return fleet_call(relays, count, RELAY_OP_READ, 0, 0, NULL, NULL, NULL, bitmaps, failed);
+}
+
+
+/*
+ * Asynchronous operations.
+ * Ops are queued to relay workers like blocking calls, but nobody waits
+ * for them: worker runs callback, or queues op to context completion queue
+ * and signals completion fd, so one event loop can drive many relays.
+ */
+
+static void completion_push(struct uhid_ctx* ctx, struct uhid_op* op)
+{
+    pthread_mutex_lock(&ctx->done_lock);
+    op->done_next = NULL;
+    *ctx->done_tail = op;
+    ctx->done_tail = &op->done_next;
+#if !defined(_WIN32)
+    if (ctx->done_fd[1] >= 0) {
+        uint64_t one = 1; /* eventfd wants 8 bytes, pipe is fine with them too */
+        if (write(ctx->done_fd[1], &one, sizeof(one)) < 0) {
+            /* Pipe is full, so it is readable anyway */
+        }
+    }
+#endif
+    pthread_mutex_unlock(&ctx->done_lock);
+}
+
+
+static struct uhid_op* op_submit(struct uhid_relay* relay, int op_code, uint32_t mask,
+                                 uint32_t value, uhid_op_cb cb, void* user)
+{
+    struct uhid_op* op = ctx_alloc(relay->ctx, NULL, sizeof(*op));
+    if (!op)
+        return NULL;
+    memset(op, 0, sizeof(*op));
+    op->cmd.async = 1;
+    op->cmd.op = op_code;
+    op->cmd.mask = mask;
+    op->cmd.value = value;
+    op->relay = uhid_ref(relay);
+    op->cb = cb;
+    op->user = user;
+    if (relay_submit(relay, &op->cmd) < 0) {
+        uhid_close(relay);
+        free(op);
+        return NULL;
+    }
+    return op;
+}
+
+
+struct uhid_op* uhid_submit_get(struct uhid_relay* relay, uhid_op_cb cb, void* user)
+{
+    return op_submit(relay, RELAY_OP_READ, 0, 0, cb, user);
+}
+
+
+struct uhid_op* uhid_submit_set(struct uhid_relay* relay, uint32_t mask, uint32_t value,
+                                uhid_op_cb cb, void* user)
+{
+    return op_submit(relay, RELAY_OP_WRITE, mask, value, cb, user);
+}
+
+
+int uhid_op_result(const struct uhid_op* op, uint32_t* bitmap)
+{
+    if (!__atomic_load_n(&op->cmd.done, __ATOMIC_ACQUIRE)) {
+        errno = EINPROGRESS;
+        return -1;
+    }
+    if (bitmap)
+        *bitmap = op->cmd.result;
+    if (op->cmd.rc < 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+
+struct uhid_relay* uhid_op_relay(const struct uhid_op* op)
+{
+    return op->relay;
+}
+
+
+void* uhid_op_user(const struct uhid_op* op)
+{
+    return op->user;
+}
+
+
+void uhid_op_free(struct uhid_op* op)
+{
+    if (!op)
+        return;
+    uhid_close(op->relay);
+    free(op);
+}
+
+
+int uhid_completion_fd(struct uhid_ctx* ctx)
+{
+#if defined(_WIN32)
+    (void)ctx;
+    errno = ENOSYS;
+    return -1;
+#else
+    int fd;
+    pthread_mutex_lock(&ctx->done_lock);
+    if (ctx->done_fd[0] < 0) {
+#if defined(__linux__)
+        ctx->done_fd[0] = ctx->done_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+        if (pipe(ctx->done_fd) == 0) {
+            fcntl(ctx->done_fd[0], F_SETFL, O_NONBLOCK);
+            fcntl(ctx->done_fd[1], F_SETFL, O_NONBLOCK);
+        } else {
+            ctx->done_fd[0] = ctx->done_fd[1] = -1;
+        }
+#endif
+        /* Ops completed before fd existed must still wake up caller */
+        if (ctx->done_head && ctx->done_fd[1] >= 0) {
+            uint64_t one = 1;
+            if (write(ctx->done_fd[1], &one, sizeof(one)) < 0) {
+                /* can't happen with empty eventfd or pipe */
+            }
+        }
+    }
+    fd = ctx->done_fd[0];
+    pthread_mutex_unlock(&ctx->done_lock);
+    return fd;
+#endif
+}
+
+
+int uhid_reap(struct uhid_ctx* ctx, struct uhid_op** ops, int max)
+{
+    int count = 0;
+    pthread_mutex_lock(&ctx->done_lock);
+#if !defined(_WIN32)
+    if (ctx->done_fd[0] >= 0) {
+        uint64_t buf[16];
+        while (read(ctx->done_fd[0], buf, sizeof(buf)) > 0)
+            ;
+    }
+#endif
+    while (count < max && ctx->done_head) {
+        ops[count++] = ctx->done_head;
+        ctx->done_head = ctx->done_head->done_next;
+    }
+    if (!ctx->done_head) {
+        ctx->done_tail = &ctx->done_head;
+    }
+#if !defined(_WIN32)
+    else if (ctx->done_fd[1] >= 0) {
+        /* Some ops left, keep fd readable */
+        uint64_t one = 1;
+        if (write(ctx->done_fd[1], &one, sizeof(one)) < 0) {
+            /* fd is readable anyway */
+        }
+    }
+#endif
+    pthread_mutex_unlock(&ctx->done_lock);
+    return count;
+}
+
+
+#if defined(HAVE_IO_URING)
+
+/*
+ * Minimal io_uring wrapper, just enough to submit batch of writes
+ * with one system call.  hidraw output reports are plain write()s
+ * to /dev/hidrawN, so with hidraw backend writes to many relays
+ * can be queued together instead of one syscall per write.
+ * Context keeps one ring, with report buffer for every entry,
+ * and every hidraw relay keeps its node open, so fleet write
+ * costs nothing but io_uring_enter() calls.
+ */
+
+#define URING_MAX_ENTRIES 256
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*  sq_ring;
+    size_t sq_ring_len;
+    void*  cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    /* indexed by entry of batch */
+    struct iovec* iov;
+    unsigned char (*bufs)[9];
+    int* owner;                      /* relay of entry, -1 once completed */
+};
+
+static void uring_exit(struct uring* ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
+    free(ring->iov);
+    free(ring->bufs);
+    free(ring->owner);
+}
+
+
+static void uring_free(struct uring* ring)
+{
+    if (!ring)
+        return;
+    uring_exit(ring);
+    free(ring);
+}
+
+
+/*
+ * Returns 0 on success, -1 if io_uring is not available.
+ */
+
+static int uring_init(struct uring* ring, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+    ring->entries = p.sq_entries;
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes    = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring == MAP_FAILED)
+            ring->sq_ring = NULL;
+        if (ring->cq_ring == MAP_FAILED)
+            ring->cq_ring = NULL;
+        if (ring->sqes == MAP_FAILED)
+            ring->sqes = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+    ring->sq_tail  = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask  = (unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+    ring->cq_head  = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail  = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask  = (unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+    return 0;
+}
+
+
+/*
+ * Get ring of context, creating it on first use.
+ * Must be called with ring_lock held.
+ * Returns NULL if io_uring can't be used.
+ */
+
+static struct uring* uring_get(struct uhid_ctx* ctx)
+{
+    struct uring* ring;
+
+    if (ctx->ring_failed)
+        return NULL;
+    if (ctx->ring)
+        return ctx->ring;
+    ring = ctx_alloc(ctx, NULL, sizeof(*ring));
+    if (!ring)
+        return NULL;
+    if (uring_init(ring, URING_MAX_ENTRIES) < 0) {
+        free(ring);
+        ctx->ring_failed = 1;
+        return NULL;
+    }
+    ring->iov   = ctx_alloc(ctx, NULL, ring->entries * sizeof(*ring->iov));
+    ring->bufs  = ctx_alloc(ctx, NULL, ring->entries * sizeof(*ring->bufs));
+    ring->owner = ctx_alloc(ctx, NULL, ring->entries * sizeof(*ring->owner));
+    if (!ring->iov || !ring->bufs || !ring->owner || ring->entries < UHID_MAX_PORTS) {
+        uring_free(ring);
+        return NULL;
+    }
+    ctx->ring = ring;
+    return ring;
+}
+
+
+/*
+ * Write planned output reports of several relays through io_uring.
+ * Writes of one relay are linked, so they are done in planned order,
+ * while different relays proceed independently.  Relays without open
+ * hidraw node, and relays whose writes kernel did not take, are written
+ * through their handle instead.  Relays that failed are marked in failed[].
+ * Must be called with io_lock of every relay held.
+ * Returns 0 if writes were issued, -1 if io_uring can't be used.
+ */
+
+static int uring_relay_writes(struct uhid_relay** relays, int count,
+                              struct relay_write (*plans)[UHID_MAX_PORTS], const int* nplan,
+                              int* failed)
+{
+    struct uhid_ctx* ctx = relays[0]->ctx;
+    struct uring* ring;
+    unsigned total = 0;
+    unsigned tail;
+    unsigned head;
+    unsigned queued;
+    unsigned submitted;
+    unsigned reaped;
+    int broken = 0;
+    int first;
+    int last;
+    int ret;
+    int i, k;
+
+    for (i = 0; i < count; i++) {
+        if (relays[i]->hidraw_fd >= 0)
+            total += nplan[i];
+    }
+    if (total == 0)
+        return -1;
+    pthread_mutex_lock(&ctx->ring_lock);
+    ring = uring_get(ctx);
+    if (!ring) {
+        pthread_mutex_unlock(&ctx->ring_lock);
+        return -1;
+    }
+    /* failed[i] < 0 marks relay to be written through its handle */
+    for (i = 0; i < count; i++) {
+        failed[i] = (nplan[i] > 0 && relays[i]->hidraw_fd < 0) ? -1 : 0;
+    }
+
+    /* Queue whole relays while they fit into ring, then submit and reap */
+    for (first = 0, last = 0; first < count && !broken; first = last) {
+        tail = *ring->sq_tail;
+        queued = 0;
+        for (last = first; last < count; last++) {
+            if (nplan[last] == 0 || relays[last]->hidraw_fd < 0)
+                continue;
+            if (queued + nplan[last] > ring->entries)
+                break;
+            for (k = 0; k < nplan[last]; k++) {
+                unsigned idx = tail & *ring->sq_mask;
+                struct io_uring_sqe* sqe = &ring->sqes[idx];
+                ring->bufs[queued][0] = 0;
+                ring->bufs[queued][1] = plans[last][k].opcode;
+                ring->bufs[queued][2] = plans[last][k].port;
+                memset(&ring->bufs[queued][3], 0, 6);
+                ring->iov[queued].iov_base = ring->bufs[queued];
+                ring->iov[queued].iov_len = sizeof(ring->bufs[queued]);
+                ring->owner[queued] = last;
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = IORING_OP_WRITEV;
+                sqe->fd = relays[last]->hidraw_fd;
+                sqe->addr = (uintptr_t)&ring->iov[queued];
+                sqe->len = 1;
+                sqe->user_data = queued;
+                if (k < nplan[last] - 1)
+                    sqe->flags = IOSQE_IO_LINK;
+                ring->sq_array[idx] = idx;
+                tail++;
+                queued++;
+            }
+        }
+        if (queued == 0)
+            break;
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        /* Submit and wait for all of them with one call */
+        do {
+            ret = syscall(__NR_io_uring_enter, ring->fd, queued, queued,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        submitted = ret < 0 ? 0 : (unsigned)ret;
+        if (submitted < queued) {
+            /* Take back entries kernel did not consume, write them through handles */
+            __atomic_store_n(ring->sq_tail, tail - (queued - submitted), __ATOMIC_RELEASE);
+            for (k = submitted; k < (int)queued; k++) {
+                failed[ring->owner[k]] = -1;
+                ring->owner[k] = -1;
+            }
+            broken = 1;
+        }
+        for (reaped = 0; reaped < submitted; ) {
+            head = *ring->cq_head;
+            if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                ret = syscall(__NR_io_uring_enter, ring->fd, 0, submitted - reaped,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0 && errno != EINTR)
+                    break;
+                continue;
+            }
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            k = ring->owner[cqe->user_data];
+            /* short write is lost report too */
+            if (k >= 0 && failed[k] == 0 && cqe->res != (int)sizeof(ring->bufs[0]))
+                failed[k] = 1;
+            ring->owner[cqe->user_data] = -1;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            reaped++;
+        }
+        if (reaped < submitted) {
+            /* Writes may still complete, ring is not used again until uhid_free() */
+            for (k = 0; k < (int)submitted; k++) {
+                if (ring->owner[k] >= 0 && failed[ring->owner[k]] == 0)
+                    failed[ring->owner[k]] = 1;
+            }
+            ctx->ring_failed = 1;
+            broken = 1;
+        }
+    }
+    /* Relays not queued yet when ring broke */
+    for (i = last; broken && i < count; i++) {
+        if (nplan[i] > 0)
+            failed[i] = -1;
+    }
+    pthread_mutex_unlock(&ctx->ring_lock);
+
+    for (i = 0; i < count; i++) {
+        if (failed[i] < 0)
+            failed[i] = (issue_relay_writes(relays[i], plans[i], nplan[i]) < 0);
+    }
+    return 0;
+}
+
+#endif /* HAVE_IO_URING */
+
+
+static int compare_relays(const void* a, const void* b)
+{
+    const struct uhid_relay* ra = *(struct uhid_relay* const*)a;
+    const struct uhid_relay* rb = *(struct uhid_relay* const*)b;
+    return (ra > rb) - (ra < rb);
+}
+
+
+/*
+ * Set ports of several relays at once.  If masks is NULL, every relay
+ * gets same mask and value, otherwise relay i gets masks[i] and values[i].
+ * With scheduling lanes, writes are left to relay workers, which take turns
+ * in their lanes, instead of being issued all together.  So are writes
+ * with port dwell, which only relay workers keep track of.
+ */
+
+static int fleet_set(struct uhid_relay** relays, int count, uint32_t mask, uint32_t value,
+                     const uint32_t* masks, const uint32_t* values, int* failed)
+{
+    struct relay_write (*plans)[UHID_MAX_PORTS];
+    struct uhid_ctx* ctx;
+    struct uhid_relay** locked;
+    int* nplan;
+    int* fail;
+    uint32_t target;
+    int known;
+    int rc = 0;
+    int i;
+
+    if (count <= 0)
+        return 0;
+    ctx    = relays[0]->ctx;
+    if (__atomic_load_n(&ctx->lane_mode, __ATOMIC_RELAXED) != UHID_LANES_NONE ||
+        ctx->dwell_on > 0 || ctx->dwell_off > 0)
+        return fleet_call(relays, count, RELAY_OP_WRITE, mask, value, masks, values, NULL, NULL, failed);
+    plans  = ctx_alloc(ctx, NULL, count * sizeof(*plans));
+    locked = ctx_alloc(ctx, NULL, count * sizeof(*locked));
+    nplan  = ctx_alloc(ctx, NULL, count * sizeof(*nplan));
+    fail   = ctx_alloc(ctx, NULL, count * sizeof(*fail));
+    if (!plans || !locked || !nplan || !fail) {
+        free(plans);
+        free(locked);
+        free(nplan);
+        free(fail);
+        return -1;
+    }
+    /* Lock relays in address order, so concurrent fleet operations can't deadlock */
+    memcpy(locked, relays, count * sizeof(*locked));
+    qsort(locked, count, sizeof(*locked), compare_relays);
+    for (i = 0; i < count; i++) {
+        if (i == 0 || locked[i] != locked[i - 1])
+            pthread_mutex_lock(&locked[i]->io_lock);
+    }
+    for (i = 0; i < count; i++) {
+        fail[i] = 0;
+        if (masks)
+            nplan[i] = prepare_relay_writes(relays[i], masks[i], values[i], plans[i], &target, &known);
+        else
+            nplan[i] = prepare_relay_writes(relays[i], mask, value, plans[i], &target, &known);
+    }
+#if defined(HAVE_IO_URING)
+    /* paced writes can't be issued all together */
+    if (__atomic_load_n(&ctx->nrates, __ATOMIC_RELAXED) > 0 ||
+        uring_relay_writes(relays, count, plans, nplan, fail) < 0)
+#endif
+    {
+        for (i = 0; i < count; i++) {
+            if (issue_relay_writes(relays[i], plans[i], nplan[i]) < 0)
+                fail[i] = 1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (i == 0 || locked[i] != locked[i - 1])
+            pthread_mutex_unlock(&locked[i]->io_lock);
+        if (failed)
+            failed[i] = fail[i];
+        if (fail[i])
+            rc = -1;
+    }
+    free(plans);
+    free(locked);
+    free(nplan);
+    free(fail);
+    if (rc < 0)
+        errno = EIO;
+    return rc;
+}
+
+
+int uhid_set_bitmaps(struct uhid_relay** relays, int count, uint32_t mask, uint32_t value,
+                     int* failed)
+{
+    return fleet_set(relays, count, mask, value, NULL, NULL, failed);
+}
+
+
+int uhid_apply_bitmaps(struct uhid_relay** relays, int count, const uint32_t* masks,
+                       const uint32_t* values, int* failed)
+{
+    return fleet_set(relays, count, 0, 0, masks, values, failed);
+}
+
+
+/*
+ * Port sets.
+ * Port set is dense bitset of ports of all relays in context: word i holds
+ * ports of relay with id i, so set algebra is one bitwise operation per relay.
+ * Words beyond nwords are empty.
+ */
+
+struct uhid_ports {
+    struct uhid_ctx* ctx;
+    uint32_t* words;                 /* indexed by relay id */
+    int nwords;
+};
+
+
+/* Make room for relay id, returns -1 if out of memory */
+
+static int ports_grow(struct uhid_ports* set, int id)
+{
+    uint32_t* words;
+    int nwords;
+    if (id < set->nwords)
+        return 0;
+    nwords = set->nwords ? set->nwords : 16;
+    while (nwords <= id)
+        nwords *= 2;
+    words = ctx_alloc(set->ctx, set->words, nwords * sizeof(*words));
+    if (!words)
+        return -1;
+    memset(words + set->nwords, 0, (nwords - set->nwords) * sizeof(*words));
+    set->words = words;
+    set->nwords = nwords;
+    return 0;
+}
+
+
+struct uhid_ports* uhid_ports_new(struct uhid_ctx* ctx)
+{
+    struct uhid_ports* set = ctx_alloc(ctx, NULL, sizeof(*set));
+    if (!set)
+        return NULL;
+    set->ctx = ctx;
+    set->words = NULL;
+    set->nwords = 0;
+    if (ports_grow(set, uhid_max_id(ctx)) < 0) {
+        free(set);
+        return NULL;
+    }
+    return set;
+}
+
+
+void uhid_ports_free(struct uhid_ports* set)
+{
+    if (!set)
+        return;
+    free(set->words);
+    free(set);
+}
+
+
+void uhid_ports_clear(struct uhid_ports* set)
+{
+    memset(set->words, 0, set->nwords * sizeof(*set->words));
+}
+
+
+int uhid_ports_add(struct uhid_ports* set, const struct uhid_relay* relay, uint32_t mask)
+{
+    if (ports_grow(set, relay->id) < 0)
+        return -1;
+    set->words[relay->id] |= mask & relay_port_mask(relay);
+    return 0;
+}
+
+
+void uhid_ports_del(struct uhid_ports* set, const struct uhid_relay* relay, uint32_t mask)
+{
+    if (relay->id < set->nwords)
+        set->words[relay->id] &= ~mask;
+}
+
+
+uint32_t uhid_ports_get(const struct uhid_ports* set, const struct uhid_relay* relay)
+{
+    return relay->id < set->nwords ? set->words[relay->id] : 0;
+}
+
+
+int uhid_ports_or(struct uhid_ports* set, const struct uhid_ports* other)
+{
+    int i;
+    if (other->nwords > 0 && ports_grow(set, other->nwords - 1) < 0)
+        return -1;
+    for (i = 0; i < other->nwords; i++) {
+        set->words[i] |= other->words[i];
+    }
+    return 0;
+}
+
+
+void uhid_ports_and(struct uhid_ports* set, const struct uhid_ports* other)
+{
+    int n = set->nwords < other->nwords ? set->nwords : other->nwords;
+    int i;
+    for (i = 0; i < n; i++) {
+        set->words[i] &= other->words[i];
+    }
+    for (; i < set->nwords; i++) {
+        set->words[i] = 0;
+    }
+}
+
+
+void uhid_ports_andnot(struct uhid_ports* set, const struct uhid_ports* other)
+{
+    int n = set->nwords < other->nwords ? set->nwords : other->nwords;
+    int i;
+    for (i = 0; i < n; i++) {
+        set->words[i] &= ~other->words[i];
+    }
+}
+
+
+int uhid_ports_count(const struct uhid_ports* set)
+{
+    int count = 0;
+    int i;
+    for (i = 0; i < set->nwords; i++) {
+        count += __builtin_popcount(set->words[i]);
+    }
+    return count;
+}
+
+
+int uhid_ports_relays(const struct uhid_ports* set, struct uhid_relay** relays, uint32_t* masks,
+                      int max)
+{
+    struct uhid_ctx* ctx = set->ctx;
+    int count = 0;
+    int n;
+    int i;
+
+    pthread_rwlock_rdlock(&ctx->lock);
+    n = set->nwords < ctx->nids ? set->nwords : ctx->nids;
+    for (i = 0; i < n; i++) {
+        if (!set->words[i] || !ctx->relays[i])
+            continue;
+        if (count < max) {
+            relays[count] = uhid_ref(ctx->relays[i]);
+            if (masks)
+                masks[count] = set->words[i];
+        }
+        count++;
+    }
+    pthread_rwlock_unlock(&ctx->lock);
+    return count;
+}
+
+
+/*
+ * Get referenced relays having ports in set, or all relays if set is NULL,
+ * with their ports.  Returns count, or -1 if out of memory.
+ */
+
+static int ports_relays(struct uhid_ctx* ctx, const struct uhid_ports* set,
+                        struct uhid_relay*** relays, uint32_t** masks)
+{
+    int max = 0;
+    int count;
+    int i;
+
+    *relays = NULL;
+    *masks = NULL;
+    for (;;) {
+        if (set)
+            count = uhid_ports_relays(set, *relays, *masks, max);
+        else
+            count = uhid_list(ctx, *relays, max);
+        if (count <= max)
+            return count;
+        for (i = 0; i < max; i++) {
+            uhid_close((*relays)[i]);
+        }
+        /* relays were added meanwhile, try again with bigger arrays */
+        free(*relays);
+        free(*masks);
+        max = count;
+        *relays = ctx_alloc(ctx, NULL, max * sizeof(**relays));
+        *masks  = ctx_alloc(ctx, NULL, max * sizeof(**masks));
+        if (!*relays || !*masks) {
+            free(*relays);
+            free(*masks);
+            *relays = NULL;
+            *masks = NULL;
+            return -1;
+        }
+    }
+}
+
+
+static void release_ports_relays(struct uhid_relay** relays, uint32_t* masks, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        uhid_close(relays[i]);
+    }
+    free(relays);
+    free(masks);
+}
+
+
+int uhid_ports_read(struct uhid_ports* state, const struct uhid_ports* which)
+{
+    struct uhid_relay** relays;
+    uint32_t* bitmaps;
+    int* failed = NULL;
+    int count;
+    int rc = -1;
+    int i;
+
+    count = ports_relays(state->ctx, which, &relays, &bitmaps);
+    if (count < 0)
+        return -1;
+    uhid_ports_clear(state);
+    if (count > 0)
+        failed = ctx_alloc(state->ctx, NULL, count * sizeof(*failed));
+    if (count == 0 || failed) {
+        rc = uhid_get_bitmaps(relays, count, bitmaps, failed);
+        for (i = 0; i < count; i++) {
+            if (!failed[i] && uhid_ports_add(state, relays[i], bitmaps[i]) < 0)
+                rc = -1;
+        }
+    }
+    free(failed);
+    release_ports_relays(relays, bitmaps, count);
+    return rc;
+}
+
+
+int uhid_ports_apply(const struct uhid_ports* mask, const struct uhid_ports* value)
+{
+    struct uhid_relay** relays;
+    uint32_t* masks;
+    uint32_t* values = NULL;
+    int count;
+    int rc = -1;
+    int i;
+
+    count = ports_relays(mask->ctx, mask, &relays, &masks);
+    if (count < 0)
+        return -1;
+    if (count > 0)
+        values = ctx_alloc(mask->ctx, NULL, count * sizeof(*values));
+    if (count == 0 || values) {
+        for (i = 0; i < count; i++) {
+            values[i] = value ? uhid_ports_get(value, relays[i]) : 0;
+        }
+        rc = uhid_apply_bitmaps(relays, count, masks, values, NULL);
+    }
+    free(values);
+    release_ports_relays(relays, masks, count);
+    return rc;
+}
+
+
+#if defined(__linux__)
+
+/*
+ * Hotplug monitoring with kernel uevents.
+ * Added devices are probed and registered, removed devices are dropped
+ * from registry, so relay table never needs full re-enumeration.
+ * Device path is derived from uevent: sysfs interface name (e.g. 1-1.2:1.0)
+ * for hidapi-libusb backend, or /dev/hidrawN for hidraw backend.
+ */
+
+int uhid_monitor_start(struct uhid_ctx* ctx)
+{
+    struct sockaddr_nl addr;
+    int fd;
+    if (ctx->monitor_fd >= 0)
+        return ctx->monitor_fd;
+    fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* kernel uevents */
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    ctx->monitor_fd = fd;
+    return fd;
+}
+
+
+void uhid_monitor_stop(struct uhid_ctx* ctx)
+{
+    if (ctx->monitor_fd >= 0)
+        close(ctx->monitor_fd);
+    ctx->monitor_fd = -1;
+    ctx->pending_count = 0;
+}
+
+
+int uhid_monitor_timeout(struct uhid_ctx* ctx)
+{
+    return ctx->pending_count > 0 ? HOTPLUG_RETRY_MS : -1;
+}
+
+
+/*
+ * Try to probe devices which were recently plugged in.
+ */
+
+static void hotplug_probe_pending(struct uhid_ctx* ctx)
+{
+    struct hotplug_probe* probe;
+    int rc;
+    int i;
+    for (i = ctx->pending_count - 1; i >= 0; i--) {
+        probe = &ctx->pending[i];
+        pthread_rwlock_wrlock(&ctx->lock);
+        rc = 0;
+        if (!registry_find_path(ctx, probe->path))
+            rc = probe_relay(ctx, probe->path, 0);
+        pthread_rwlock_unlock(&ctx->lock);
+        if (rc >= 0 || --probe->retries <= 0) {
+            *probe = ctx->pending[--ctx->pending_count];
+        }
+    }
+}
+
+
+static void hotplug_event(struct uhid_ctx* ctx, char* buf, int len)
+{
+    const char* action    = NULL;
+    const char* subsystem = NULL;
+    const char* devpath   = NULL;
+    const char* devname   = NULL;
+    const char* devtype   = NULL;
+    const char* product   = NULL;
+    const char* base;
+    char path[256];
+    char* key;
+    struct uhid_relay* relay;
+    int add;
+    int i;
+
+    /* Skip messages rebroadcast by udev, they have binary header */
+    if (len <= 0 || !strncmp(buf, "libudev", 7))
+        return;
+    buf[len] = 0;
+    for (key = buf + strlen(buf) + 1; key < buf + len; key += strlen(key) + 1) {
+        if (!strncmp(key, "ACTION=", 7))
+            action = key + 7;
+        else if (!strncmp(key, "SUBSYSTEM=", 10))
+            subsystem = key + 10;
+        else if (!strncmp(key, "DEVPATH=", 8))
+            devpath = key + 8;
+        else if (!strncmp(key, "DEVNAME=", 8))
+            devname = key + 8;
+        else if (!strncmp(key, "DEVTYPE=", 8))
+            devtype = key + 8;
+        else if (!strncmp(key, "PRODUCT=", 8))
+            product = key + 8;
+    }
+    if (!action || !subsystem || !devpath)
+        return;
+    add = !strcmp(action, "add");
+    if (!add && strcmp(action, "remove"))
+        return;
+
+    if (!strcmp(subsystem, "usb") && devtype && !strcmp(devtype, "usb_interface")) {
+        if (add && (!product || strncasecmp(product, "16c0/5df/", 9)))
+            return;
+        base = strrchr(devpath, '/');
+        snprintf(path, sizeof(path), "%s", base ? base + 1 : devpath);
+    } else if (!strcmp(subsystem, "hidraw") && devname) {
+        /* Parent HID device name contains bus:vendor:product */
+        if (add && !strstr(devpath, ":16C0:05DF."))
+            return;
+        snprintf(path, sizeof(path), "/dev/%s", devname);
+    } else {
+        return;
+    }
+
+    if (add) {
+        for (i = 0; i < ctx->pending_count; i++) {
+            if (!strcmp(ctx->pending[i].path, path))
+                return;
+        }
+        if (ctx->pending_count < HOTPLUG_PENDING) {
+            strcpy(ctx->pending[ctx->pending_count].path, path);
+            ctx->pending[ctx->pending_count].retries = HOTPLUG_RETRIES;
+            ctx->pending_count++;
+        }
+        return;
+    }
+
+    for (i = 0; i < ctx->pending_count; i++) {
+        if (!strcmp(ctx->pending[i].path, path))
+            ctx->pending[i--] = ctx->pending[--ctx->pending_count];
+    }
+    pthread_rwlock_wrlock(&ctx->lock);
+    relay = registry_find_path(ctx, path);
+    if (relay) {
+        notify(ctx, UHID_EVENT_REMOVED, relay->serial, relay->path);
+        registry_remove(ctx, relay);
+    }
+    pthread_rwlock_unlock(&ctx->lock);
+}
+
+
+void uhid_monitor_process(struct uhid_ctx* ctx)
+{
+    char buf[8192];
+    ssize_t len;
+    if (ctx->monitor_fd < 0)
+        return;
+    while ((len = recv(ctx->monitor_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+        hotplug_event(ctx, buf, len);
+    }
+    hotplug_probe_pending(ctx);
+}
+
+#else
+
+int uhid_monitor_start(struct uhid_ctx* ctx)
+{
+    (void)ctx;
+    errno = ENOSYS;
+    return -1;
+}
+
+
+void uhid_monitor_stop(struct uhid_ctx* ctx)
+{
+    (void)ctx;
+}
+
+
+int uhid_monitor_timeout(struct uhid_ctx* ctx)
+{
+    (void)ctx;
+    return -1;
+}
+
+
+void uhid_monitor_process(struct uhid_ctx* ctx)
+{
+    (void)ctx;
+}
+
+#endif /* __linux__ */
@@ -9,9 +9,14 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE   /* for flock() */
+#if defined(__linux__)
+#define _GNU_SOURCE       /* for struct ucred */
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <getopt.h>
@@ -24,53 +29,131 @@
 #include <process.h>
 #define strcasecmp _stricmp
 #define strncasecmp _strnicmp
+#define strtok_r strtok_s
 #else
 #include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #endif
 
+#include <pthread.h>
+#include <stdarg.h>
+
 #if _POSIX_C_SOURCE >= 199309L
 #include <time.h>   /* for nanosleep */
 #endif
 
-#include <hidapi/hidapi.h>
+#include "uhidctl.h"
 
 
-/* Max number of relay ports supported */
-
-#define MAX_RELAY_PORTS  8
-#define ALL_RELAY_PORTS  ((1 << MAX_RELAY_PORTS) - 1) /* bitmask */
+/* Lock files of relays, see lock_relay() */
+#ifndef UHIDCTL_LOCK_DIR
+#define UHIDCTL_LOCK_DIR  "/run/lock"
+#endif
 
 #define POWER_KEEP       (-1)
 #define POWER_OFF        0
 #define POWER_ON         1
 #define POWER_CYCLE      2
 
-struct relay_info {
-    char serial[16];
-    int  nports;
-    char path[256];
-};
+/* Output formats of relay state, see output_relay() */
+#define FORMAT_TEXT      0
+#define FORMAT_JSON      1   /* array of relay objects, one per line */
+#define FORMAT_JSONL     2   /* relay object per line */
+#define FORMAT_CSV       3   /* header, then relay per row */
+
+static struct uhid_ctx* ctx = NULL;
+
+/* Report relays added and removed by hotplug (daemon mode) */
+static int report_hotplug = 0;
 
+/* Set if some relay could not be opened, permission issue? */
+static int perm_failed = 0;
 
-/* Array of all enumerated relays */
-#define MAX_RELAYS 64
-static struct relay_info relays[MAX_RELAYS];
-static int relay_count = 0;
+/* Relays selected to operate on, and ports to operate on for each of them */
+static struct uhid_relay** selected = NULL;
+static uint32_t* selected_ports = NULL;
+static int* selected_locks = NULL;       /* lock fd for every selected relay, see lock_selected() */
+static int selected_count = 0;
 
 
 /* default options */
-static char opt_relay[16] = "";          /* Serial number of relay to operate on */
+static char* opt_relay = NULL;           /* Serial number(s) of relay to operate on */
+static char* opt_location = NULL;        /* USB location(s) of relay to operate on, e.g. 1-1.2 */
 static char opt_newserial[16] = "";      /* New serial number to assign, only used for -s */
-static int opt_ports  = ALL_RELAY_PORTS; /* Bitmask of relay ports to operate on */
-static int opt_action = POWER_KEEP;      /* Power action */
+static uint32_t opt_ports = UHID_ALL_PORTS; /* Bitmask of relay ports to operate on */
+static char* opt_relay_ports = NULL;     /* Relay-qualified port list, e.g. ABCDE:1-4,FGHIJ:2 */
+static char* opt_group = NULL;           /* Named group of relay ports to operate on */
+static char* opt_config = "/etc/uhidctl.conf"; /* Group definitions */
+static int opt_action = POWER_KEEP;      /* Power action (last one given) */
+static char* opt_exclude = NULL;         /* Ports to leave alone: group or relay-qualified list */
+static int opt_only = POWER_KEEP;        /* Only ports which are now ON or OFF */
 static double opt_delay = 2;             /* Delay for power cycle */
+static char* opt_daemon = NULL;          /* Unix socket to serve requests on */
+static int opt_interactive = 0;          /* Read commands from stdin */
+static double opt_cache_ttl = 500;       /* Daemon state cache TTL, ms */
+static double opt_coalesce = 0;          /* Daemon write coalescing window, ms */
+static double opt_dwell_on = 0;          /* Daemon min time port stays ON, ms */
+static double opt_dwell_off = 0;         /* Daemon min time port stays OFF, ms */
+static int opt_lanes = UHID_LANES_NONE;  /* Group relays by USB bus or hub */
+static int opt_lane_width = 1;           /* Relays accessed at once in one lane */
+static char* opt_save_state = NULL;      /* File to save relay state to */
+static char* opt_restore_state = NULL;   /* File to restore relay state from */
+static char* opt_provision = NULL;       /* Serial number pattern, e.g. RK### */
+static char* opt_map = NULL;             /* File to save provisioned serials to */
+static char* opt_audit = NULL;           /* Audit log of port changes */
+static char* opt_query = NULL;           /* Time range to print from audit log */
+static int opt_format = FORMAT_TEXT;     /* Output format of relay state */
+static char* opt_calibrate = NULL;       /* Profile key: serial or model */
+static char* opt_profiles = "/etc/uhidctl.profiles"; /* Write rate profiles */
+
+/*
+ * Every -a action takes ports from -p with same position on command line,
+ * or from the only -p.  All of them are compiled into one plan per relay.
+ */
+#define MAX_ACTIONS  32
+
+struct port_arg {
+    uint32_t ports;
+    char* relay_ports;                   /* relay-qualified port list, or NULL */
+};
+
+static int actions[MAX_ACTIONS];
+static int actions_count = 0;
+static struct port_arg port_args[MAX_ACTIONS];
+static int port_args_count = 0;
 
 static const struct option long_options[] = {
     { "relay" ,    required_argument, NULL, 'l' },
+    { "location",  required_argument, NULL, 'L' },
     { "ports",     required_argument, NULL, 'p' },
     { "action",    required_argument, NULL, 'a' },
     { "delay",     required_argument, NULL, 'd' },
     { "setserial", required_argument, NULL, 's' },
+    { "daemon",    required_argument, NULL, 'D' },
+    { "interactive", no_argument,     NULL, 'i' },
+    { "cache-ttl", required_argument, NULL, 'T' },
+    { "coalesce",  required_argument, NULL, 'W' },
+    { "dwell",     required_argument, NULL, 'w' },
+    { "lanes",     required_argument, NULL, 'b' },
+    { "group",     required_argument, NULL, 'g' },
+    { "exclude",   required_argument, NULL, 'x' },
+    { "only",      required_argument, NULL, 'o' },
+    { "config",    required_argument, NULL, 'c' },
+    { "save-state", required_argument, NULL, 'S' },
+    { "restore-state", required_argument, NULL, 'R' },
+    { "provision", required_argument, NULL, 'P' },
+    { "map",       required_argument, NULL, 'M' },
+    { "audit",     required_argument, NULL, 'A' },
+    { "query",     required_argument, NULL, 'Q' },
+    { "format",    required_argument, NULL, 'f' },
+    { "calibrate", optional_argument, NULL, 'C' },
+    { "profiles",  required_argument, NULL, 'F' },
     { "version",   no_argument,       NULL, 'v' },
     { "help",      no_argument,       NULL, 'h' },
     { 0,           0,                 NULL, 0   },
@@ -85,22 +168,65 @@ int print_usage()
         "Without options, show status for all relays.\n"
         "\n"
         "Options [defaults in brackets]:\n"
-        "--relay,     -l - specific relay to operate on.\n"
-        "--ports,     -p - ports to operate on [all ports].\n"
+        "--relay,     -l - specific relay(s) to operate on, comma separated.\n"
+        "--location,  -L - relay(s) at USB location, e.g. 1-1.2, only they are opened.\n"
+        "--ports,     -p - ports to operate on [all ports],\n"
+        "                  or RELAY:PORTS list, e.g. ABCDE:1-4,FGHIJ:2.\n"
         "--action,    -a - action to off/on/cycle (0/1/2) for affected ports.\n"
+        "                  Several -a may be given, each with its own -p.\n"
         "--delay,     -d - delay for power cycle [%g sec].\n"
+        "--group,     -g - named group of relay ports to operate on.\n"
+        "--exclude,   -x - group or RELAY:PORTS list to leave alone.\n"
+        "--only,      -o - on|off - only ports which are now ON or OFF.\n"
+        "--config,    -c - file with group definitions [%s].\n"
+        "--format,    -f - text|json|jsonl|csv - format of relay state [text].\n"
         "--setserial, -s - set new relay serial number.\n"
+        "--save-state,    -S - save state of selected relays to file.\n"
+        "--restore-state, -R - restore relays saved in file, changing only ports that differ.\n"
+        "--provision, -P - give selected relays unique serials from pattern, e.g. RK###.\n"
+        "--map,       -M - file to save provisioned serials with relay paths to.\n"
+        "--audit,     -A - append every port change to binary audit log.\n"
+        "--query,     -Q - FROM[,TO] - print audit log records of relays given with -l\n"
+        "                  [all], time is epoch seconds or YYYY-MM-DD[ HH:MM[:SS]].\n"
+        "--calibrate[=serial|model], -C - find highest write rate of relay without\n"
+        "                  dropped writes, save it for relay serial [or relay model].\n"
+        "--profiles,  -F - file with write rates to pace relays by [%s].\n"
+        "--daemon,    -D - serve requests on unix socket.\n"
+        "--interactive, -i - interactive shell, relays stay open between commands.\n"
+        "--cache-ttl, -T - daemon relay state cache TTL [%g ms].\n"
+        "--coalesce,  -W - daemon window to merge writes to same relay [%g ms].\n"
+        "--dwell,     -w - ON_MS[:OFF_MS] - daemon min time port stays ON and OFF,\n"
+        "                  faster toggles collapse to last requested state [0].\n"
+        "--lanes,     -b - bus|hub[:WIDTH] - access at most WIDTH relays [1]\n"
+        "                  on one USB bus or hub at once.\n"
         "--version,   -v - print program version.\n"
         "--help,      -h - print this text.\n"
         "\n"
         "Send bugs and requests to: https://github.com/mvp/uhidctl\n"
         "version: %s\n",
         opt_delay,
+        opt_config,
+        opt_profiles,
+        opt_cache_ttl,
+        opt_coalesce,
         PROGRAM_VERSION
     );
     return 0;
 }
 
+/* cross-platform monotonic clock, in milliseconds */
+
+double now_ms(void)
+{
+#if defined(_WIN32)
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
 /* cross-platform sleep function */
 
 void sleep_ms(int milliseconds)
@@ -117,22 +243,27 @@ void sleep_ms(int milliseconds)
 #endif
 }
 
+
 /*
  * Convert port list into bitmap.
  * Following port list specifications are equivalent:
  *   1,3,4,5,11,12,13
  *   1,3-5,11-13
- * Returns: bitmap of specified ports, max port is MAX_RELAY_PORTS.
+ *   all
+ * Returns: bitmap of specified ports, max port is UHID_MAX_PORTS,
+ * or 0 if port list is invalid.
  */
 
-static int ports2bitmap(char* const portlist)
+static uint32_t ports2bitmap(const char* portlist)
 {
-    int ports = 0;
-    char* position = portlist;
-    char* comma;
+    uint32_t ports = 0;
+    const char* position = portlist;
+    const char* comma;
     char* dash;
     int len;
     int i;
+    if (!strcasecmp(portlist, "all"))
+        return UHID_ALL_PORTS;
     while (position) {
         char buf[8] = {0};
         comma = strchr(position, ',');
@@ -157,14 +288,14 @@ static int ports2bitmap(char* const portlist)
         }
         if (a > b) {
             fprintf(stderr, "Bad port spec %d-%d, first port must be less than last\n", a, b);
-            exit(1);
+            return 0;
         }
-        if (a <= 0 || a > MAX_RELAY_PORTS || b <= 0 || b > MAX_RELAY_PORTS) {
-            fprintf(stderr, "Bad port spec %d-%d, port numbers must be from 1 to %d\n", a, b, MAX_RELAY_PORTS);
-            exit(1);
+        if (a <= 0 || a > UHID_MAX_PORTS || b <= 0 || b > UHID_MAX_PORTS) {
+            fprintf(stderr, "Bad port spec %d-%d, port numbers must be from 1 to %d\n", a, b, UHID_MAX_PORTS);
+            return 0;
         }
         for (i=a; i<=b; i++) {
-            ports |= (1 << (i-1));
+            ports |= UHID_PORT_BIT(i);
         }
     }
     return ports;
@@ -172,64 +303,333 @@ static int ports2bitmap(char* const portlist)
 
 
 /*
- *  Find all USB relays that we are going to work with and fill relays[] array.
- *  This applies possible constraints like serial number.
- *  Returns count of found relays or negative error code.
+ * Relay ports list, compiled from relay list, relay-qualified port list
+ * or group: ports bitmap for every named relay.  Relay may be listed twice,
+ * select_relays() merges its ports.
  */
 
-static int find_relays()
+struct port_spec {
+    char serial[16];
+    uint32_t ports;
+};
+
+struct port_list {
+    struct port_spec* specs;
+    int count;
+    int capacity;
+    int last;   /* relay that ports without relay name belong to, or -1 */
+};
+
+
+static void port_list_add(struct port_list* list, const char* serial, uint32_t ports)
 {
-    struct hid_device_info *devs, *cur_dev;
-    hid_device *handle;
-    char serial[9];
-    int nports;
-    int rc;
-    int perm_ok = 1;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->specs = realloc(list->specs, list->capacity * sizeof(*list->specs));
+        if (!list->specs) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+    }
+    snprintf(list->specs[list->count].serial, sizeof(list->specs[0].serial), "%s", serial);
+    list->specs[list->count].ports = ports;
+    list->last = list->count++;
+}
 
-    relay_count = 0;
-    devs = hid_enumerate(0, 0);
 
-    for (cur_dev = devs; cur_dev; cur_dev = cur_dev->next) {
-        if (cur_dev->product_string == NULL)
-            continue;
-        if (wcslen(cur_dev->product_string) < 8)
-            continue;
-        if (wcsncmp(cur_dev->product_string, L"USBRelay", 7))
-            continue;
+/*
+ * Add one token of comma separated list.
+ * If qualified is set, token is RELAY:PORTS, or PORTS of preceding relay,
+ * otherwise it is relay serial number, operated on opt_ports.
+ * Returns 0 on success, -1 if token is invalid.
+ */
 
-        handle = hid_open_path(cur_dev->path);
-        if (!handle) {
-            perror("Unable to open relay device");
-            perm_ok = 0; /* Permission issue? */
-            continue;
+static int port_list_token(struct port_list* list, char* token, int qualified)
+{
+    char* colon = strchr(token, ':');
+    uint32_t ports;
+    if (!qualified) {
+        port_list_add(list, token, opt_ports);
+        return 0;
+    }
+    ports = ports2bitmap(colon ? colon + 1 : token);
+    if (!ports)
+        return -1;
+    if (colon) {
+        *colon = 0;
+        port_list_add(list, token, ports);
+    } else if (list->last >= 0) {
+        list->specs[list->last].ports |= ports;
+    } else {
+        fprintf(stderr, "Ports %s must follow relay name, e.g. ABCDE:%s\n", token, token);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Split comma separated list into tokens.
+ * Returns next token in buf, or NULL at end of list.
+ */
+
+static char* next_token(const char** position, char* buf, int size)
+{
+    const char* comma;
+    int len;
+    while (*position) {
+        comma = strchr(*position, ',');
+        len = comma ? comma - *position : (int)strlen(*position);
+        while (len > 0 && isspace((unsigned char)**position)) {
+            (*position)++;
+            len--;
         }
+        while (len > 0 && isspace((unsigned char)(*position)[len - 1]))
+            len--;
+        if (len >= size)
+            len = size - 1;
+        memcpy(buf, *position, len);
+        buf[len] = 0;
+        *position = comma ? comma + 1 : NULL;
+        if (len > 0)
+            return buf;
+    }
+    return NULL;
+}
 
-        serial[0] = 1;
-        rc = hid_get_feature_report(handle, (unsigned char*)serial, sizeof(serial));
-        if (rc == -1) {
-            perror("Can't get relay serial number");
-            continue;
+
+/*
+ * Compile comma separated relay list, or relay-qualified port list.
+ * Returns 0 on success, -1 if list is invalid.
+ */
+
+static int compile_port_list(struct port_list* list, const char* text, int qualified)
+{
+    char token[32];
+    const char* position = text;
+    list->last = -1;
+    while (next_token(&position, token, sizeof(token))) {
+        if (port_list_token(list, token, qualified) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Named groups of relay ports, defined in config file one per line:
+ *   # comment
+ *   switch-psu-A  = ABCDE:1
+ *   rack3-servers = FGHIJ:1-4,KLMNO:2,5
+ *   rack3         = rack3-servers,switch-psu-A,PQRST
+ * Members are relay-qualified ports, other groups, or whole relays.
+ * Nested groups are resolved once when file is loaded, so every group
+ * is kept compiled into port list, sorted by name for binary search.
+ */
+
+struct group {
+    char* name;
+    char* text;         /* members, freed when compiled */
+    int line;
+    int state;          /* 0 - not compiled, 1 - being compiled, 2 - compiled */
+    struct port_list ports;
+};
+
+static struct group* groups = NULL;
+static int groups_count = 0;
+
+
+static int compare_groups(const void* a, const void* b)
+{
+    return strcmp(((const struct group*)a)->name, ((const struct group*)b)->name);
+}
+
+
+static struct group* find_group(const char* name)
+{
+    struct group key;
+    key.name = (char*)name;
+    if (!groups_count)
+        return NULL;
+    return bsearch(&key, groups, groups_count, sizeof(*groups), compare_groups);
+}
+
+
+/*
+ * Resolve group members into its port list.
+ * Returns 0 on success, -1 if group is invalid or nested in itself.
+ */
+
+static int compile_group(struct group* group)
+{
+    char token[64];
+    const char* position = group->text;
+    struct group* member;
+    int i;
+
+    if (group->state == 2)
+        return 0;
+    if (group->state == 1) {
+        fprintf(stderr, "%s:%d: group %s includes itself\n", opt_config, group->line, group->name);
+        return -1;
+    }
+    group->state = 1;
+    group->ports.last = -1;
+    while (next_token(&position, token, sizeof(token))) {
+        member = strchr(token, ':') ? NULL : find_group(token);
+        if (member) {
+            if (compile_group(member) < 0)
+                return -1;
+            for (i = 0; i < member->ports.count; i++) {
+                port_list_add(&group->ports, member->ports.specs[i].serial,
+                              member->ports.specs[i].ports);
+            }
+            group->ports.last = -1;
+        } else if (strchr(token, ':') || isdigit((unsigned char)token[0])) {
+            if (port_list_token(&group->ports, token, 1) < 0) {
+                fprintf(stderr, "%s:%d: bad member %s of group %s\n",
+                    opt_config, group->line, token, group->name);
+                return -1;
+            }
+        } else {
+            port_list_add(&group->ports, token, UHID_ALL_PORTS);
         }
-        if (strlen(opt_relay)>0 && strcasecmp(serial, opt_relay))
-            continue;
-        nports = wcstol(cur_dev->product_string+8, 0, 0);
-        if (nports <= 0)
+    }
+    free(group->text);
+    group->text = NULL;
+    group->state = 2;
+    return 0;
+}
+
+
+/*
+ * Load and compile all groups from config file.
+ * Returns 0 on success, -1 if file can't be read or is invalid.
+ */
+
+static int load_groups(const char* path)
+{
+    char line[4096];
+    char* name;
+    char* eq;
+    char* end;
+    FILE* f;
+    int capacity = 0;
+    int lineno = 0;
+    int i;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        for (name = line; isspace((unsigned char)*name); name++)
+            ;
+        if (*name == 0 || *name == '#')
             continue;
-        if (relay_count < MAX_RELAYS) {
-            strncpy(relays[relay_count].serial, serial, sizeof(relays[relay_count].serial));
-            relays[relay_count].nports = nports;
-            strncpy(relays[relay_count].path, cur_dev->path, sizeof(relays[relay_count].path));
-            relay_count++;
-        } else {
-            fprintf(stderr, "Too many relays!\n");
-            exit(1);
+        eq = strchr(name, '=');
+        if (!eq) {
+            fprintf(stderr, "%s:%d: expected NAME = MEMBERS\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        for (end = eq; end > name && isspace((unsigned char)end[-1]); end--)
+            ;
+        *end = 0;
+        end = eq + strcspn(eq, "#\r\n");
+        *end = 0;
+        if (groups_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            groups = realloc(groups, capacity * sizeof(*groups));
+            if (!groups) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(1);
+            }
+        }
+        memset(&groups[groups_count], 0, sizeof(*groups));
+        groups[groups_count].name = strdup(name);
+        groups[groups_count].text = strdup(eq + 1);
+        groups[groups_count].line = lineno;
+        groups_count++;
+    }
+    fclose(f);
+    qsort(groups, groups_count, sizeof(*groups), compare_groups);
+    for (i = 1; i < groups_count; i++) {
+        if (!strcmp(groups[i].name, groups[i - 1].name)) {
+            fprintf(stderr, "%s:%d: group %s is already defined\n", path, groups[i].line, groups[i].name);
+            return -1;
+        }
+    }
+    for (i = 0; i < groups_count; i++) {
+        if (compile_group(&groups[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+static void free_groups(void)
+{
+    int i;
+    for (i = 0; i < groups_count; i++) {
+        free(groups[i].name);
+        free(groups[i].text);
+        free(groups[i].ports.specs);
+    }
+    free(groups);
+    groups = NULL;
+    groups_count = 0;
+}
+
+
+/*
+ * Report relay events from library.
+ */
+
+static void relay_event(void* user, int event, const char* serial, const char* path)
+{
+    (void)user;
+    switch (event) {
+    case UHID_EVENT_ADDED:
+        if (report_hotplug) {
+            printf("Relay %s added at %s\n", serial, path);
+            fflush(stdout);
+        }
+        break;
+    case UHID_EVENT_REMOVED:
+        if (report_hotplug) {
+            printf("Relay %s removed from %s\n", serial, path);
+            fflush(stdout);
         }
-        hid_close(handle);
+        break;
+    case UHID_EVENT_OPEN_FAILED:
+        fprintf(stderr, "Unable to open relay device %s\n", path);
+        perm_failed = 1;
+        break;
+    case UHID_EVENT_UNSUPPORTED:
+        fprintf(stderr, "Relay %s has too many ports, only %d are supported!\n",
+            path, UHID_MAX_PORTS);
+        break;
     }
-    hid_free_enumeration(devs);
+}
+
+
+/*
+ *  Find all USB relays.
+ *  Returns count of found relays.
+ */
+
+static int find_relays()
+{
+    int count;
+
+    perm_failed = 0;
+    count = uhid_enumerate(ctx);
 
 #ifdef __gnu_linux__
-    if (!perm_ok) {
+    if (perm_failed) {
         fprintf(stderr,
             "There were permission problems while accessing USB.\n"
             "To fix this, run this tool as root using 'sudo uhidctl',\n"
@@ -240,60 +640,348 @@ static int find_relays()
         );
     }
 #endif
-    return relay_count;
+    return count;
 }
 
 
 /*
- * Get relay port state.
- * Return value: 0 = OFF, 1 = ON, -1 = error occured.
+ * Advisory locks between uhidctl processes.  Every relay has lock file
+ * named after its device path, which is locked shared to read relay,
+ * or exclusive to change it, so processes using different relays
+ * run in parallel.  All processes use the same directory, whoever runs them.
+ * If lock file can't be used, relay is used unlocked, with warning.
+ * Lock file is opened read only (flock() doesn't need more), never followed
+ * through symlink, and only file created here, or regular file owned by us,
+ * gets its permissions changed.
+ * Returns locked fd, or -1.
  */
 
-static int get_port_state(struct relay_info* info, int port)
+static int lock_relay(struct uhid_relay* relay, int exclusive)
 {
-    int rc;
-    hid_device *handle;
-    unsigned char buf[9] = { 1 };
+#if defined(_WIN32)
+    (void)relay;
+    (void)exclusive;
+    return -1;
+#else
+    const char* p;
+    char name[512];
+    struct stat st;
+    size_t len;
+    int fd;
 
-    if (info == NULL)
-        return -1;
-    if (port < 1 || port > info->nports)
-        return -1;
-    handle = hid_open_path(info->path);
-    if (handle == NULL)
-        return -1;
+    len = snprintf(name, sizeof(name), "%s/uhidctl-", UHIDCTL_LOCK_DIR);
+    for (p = uhid_relay_path(relay); *p && len < sizeof(name) - 6; p++) {
+        name[len++] = (*p == '/') ? '_' : *p;
+    }
+    strcpy(name + len, ".lock");
+    fd = open(name, O_RDONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        /* umask may have taken permissions other users need to lock it too */
+        fchmod(fd, 0666);
+    } else {
+        if (errno != EEXIST)
+            goto unlocked;
+        fd = open(name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            goto unlocked;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            errno = EINVAL;
+            goto unlocked;
+        }
+        if (st.st_uid == geteuid() && (st.st_mode & 0777) != 0666)
+            fchmod(fd, 0666);
+    }
+    while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) < 0) {
+        if (errno != EINTR) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            goto unlocked;
+        }
+    }
+    return fd;
 
-    rc = hid_get_feature_report(handle, buf, sizeof(buf));
-    hid_close(handle);
-    if (rc < 0)
-        return -1;
+unlocked:
+    fprintf(stderr, "Cannot lock relay %s with %s: %s, using it unlocked!\n",
+        uhid_relay_serial(relay), name, strerror(errno));
+    return -1;
+#endif
+}
 
-    rc = (buf[7] & (1 << (port - 1))) ? 1 : 0;
-    return rc;
+
+static void unlock_relay(int fd)
+{
+#if !defined(_WIN32)
+    if (fd >= 0)
+        close(fd);
+#else
+    (void)fd;
+#endif
+}
+
+
+static int compare_selected_paths(const void* a, const void* b)
+{
+    return strcmp(uhid_relay_path(selected[*(const int*)a]),
+                  uhid_relay_path(selected[*(const int*)b]));
 }
 
 
 /*
- * Set relay port state.
- * Returns new port state: 0 = OFF, 1 = ON, -1 = error occured.
+ * Lock all selected relays, in order of their paths,
+ * so processes locking several relays can't deadlock.
+ * Locks are released with selection.
  */
 
-static int set_port_state(struct relay_info* info, int port, int state)
+static void lock_selected(int exclusive)
 {
-    int rc = -1;
-    hid_device *handle;
-    unsigned char buf[9] = {0, state ? 0xFF : 0xFD, port};
+    int* order;
+    int i;
 
-    if (!info)
-        return -1;
-    if (port < 1 || port > info->nports)
+    order = malloc((selected_count + 1) * sizeof(*order));
+    selected_locks = malloc((selected_count + 1) * sizeof(*selected_locks));
+    if (!order || !selected_locks) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    for (i = 0; i < selected_count; i++) {
+        order[i] = i;
+    }
+    qsort(order, selected_count, sizeof(*order), compare_selected_paths);
+    for (i = 0; i < selected_count; i++) {
+        selected_locks[order[i]] = lock_relay(selected[order[i]], exclusive);
+    }
+    free(order);
+}
+
+
+static void release_selected(void)
+{
+    int i;
+    for (i = 0; i < selected_count; i++) {
+        if (selected_locks)
+            unlock_relay(selected_locks[i]);
+        uhid_close(selected[i]);
+    }
+    free(selected);
+    free(selected_ports);
+    free(selected_locks);
+    selected = NULL;
+    selected_ports = NULL;
+    selected_locks = NULL;
+    selected_count = 0;
+}
+
+
+/*
+ * Select relays to operate on from compiled port list.
+ * Every name is resolved with one hash lookup, and all relays sharing
+ * that serial number are selected, unless unique is set.
+ * Relay listed more than once is selected once, with all its ports.
+ * Without list, all relays are selected.
+ * Returns count of selected relays, or -1 if some relay was not found
+ * or was not unique.
+ */
+
+static int select_relays(const struct port_list* list, int unique)
+{
+    struct uhid_relay** found;
+    const struct port_spec* spec;
+    int* index;   /* by relay id: position in selected[] + 1 */
+    int max = uhid_max_id(ctx);
+    int count;
+    int i, k;
+
+    release_selected();
+    selected = malloc((max + 1) * sizeof(*selected));
+    selected_ports = malloc((max + 1) * sizeof(*selected_ports));
+    found = malloc((max + 1) * sizeof(*found));
+    index = calloc(max + 1, sizeof(*index));
+    if (!selected || !selected_ports || !found || !index) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    if (!list) {
+        selected_count = uhid_list(ctx, selected, max);
+        if (selected_count > max)
+            selected_count = max;
+        for (i = 0; i < selected_count; i++) {
+            selected_ports[i] = opt_ports;
+        }
+    }
+    for (k = 0; list && k < list->count && selected_count >= 0; k++) {
+        spec = &list->specs[k];
+        count = uhid_find(ctx, spec->serial, found, max);
+        if (count > max)
+            count = max;
+        if (count == 0) {
+            fprintf(stderr, "Relay %s not found!\n", spec->serial);
+            selected_count = -1;
+        } else if (unique && count > 1) {
+            fprintf(stderr, "More than 1 relay has serial %s:\n", spec->serial);
+            for (i = 0; i < count; i++) {
+                fprintf(stderr, "%s\n", uhid_relay_path(found[i]));
+            }
+            selected_count = -1;
+        }
+        for (i = 0; i < count; i++) {
+            int id = uhid_relay_id(found[i]);
+            if (selected_count < 0) {
+                uhid_close(found[i]);
+            } else if (index[id]) {
+                /* Same relay may be listed twice, keep only one */
+                selected_ports[index[id] - 1] |= spec->ports;
+                uhid_close(found[i]);
+            } else {
+                selected_ports[selected_count] = spec->ports;
+                selected[selected_count++] = found[i];
+                index[id] = selected_count;
+            }
+        }
+    }
+    free(found);
+    free(index);
+    if (selected_count < 0) {
+        selected_count = 0;
+        release_selected();
         return -1;
-    handle = hid_open_path(info->path);
-    if (!handle)
+    }
+    return selected_count;
+}
+
+
+/*
+ * Narrow selected ports with port set algebra: drop excluded ports,
+ * and keep only ports which are now ON (or OFF).  Relays left without
+ * ports are dropped from selection.
+ * Returns count of selected relays, or -1 if error occured.
+ */
+
+static int filter_selected(void)
+{
+    struct uhid_ports* ports = uhid_ports_new(ctx);
+    struct uhid_ports* other = uhid_ports_new(ctx);
+    struct port_list list = { NULL, 0, 0, -1 };
+    const struct port_list* excluded = &list;
+    struct uhid_relay** found;
+    struct group* group;
+    int max = uhid_max_id(ctx);
+    int rc = 0;
+    int i, k, n;
+
+    found = malloc((max + 1) * sizeof(*found));
+    if (!ports || !other || !found) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    for (i = 0; i < selected_count; i++) {
+        uhid_ports_add(ports, selected[i], selected_ports[i]);
+    }
+    if (opt_exclude) {
+        if (!strchr(opt_exclude, ':')) {
+            group = (groups_count > 0 || load_groups(opt_config) == 0) ? find_group(opt_exclude) : NULL;
+            if (group)
+                excluded = &group->ports;
+            else {
+                fprintf(stderr, "Group %s is not defined in %s!\n", opt_exclude, opt_config);
+                rc = -1;
+            }
+        } else if (compile_port_list(&list, opt_exclude, 1) < 0) {
+            rc = -1;
+        }
+        /* relays which are not connected have nothing to exclude */
+        for (k = 0; rc == 0 && k < excluded->count; k++) {
+            n = uhid_find(ctx, excluded->specs[k].serial, found, max);
+            for (i = 0; i < n && i < max; i++) {
+                uhid_ports_add(other, found[i], excluded->specs[k].ports);
+                uhid_close(found[i]);
+            }
+        }
+        uhid_ports_andnot(ports, other);
+    }
+    if (rc == 0 && opt_only != POWER_KEEP) {
+        if (uhid_ports_read(other, ports) < 0) {
+            fprintf(stderr, "Cannot read relay state!\n");
+            rc = -1;
+        } else if (opt_only == POWER_ON) {
+            uhid_ports_and(ports, other);
+        } else {
+            uhid_ports_andnot(ports, other);
+        }
+    }
+    if (rc == 0) {
+        for (i = 0, n = 0; i < selected_count; i++) {
+            uint32_t mask = uhid_ports_get(ports, selected[i]);
+            if (mask) {
+                selected[n] = selected[i];
+                if (selected_locks)
+                    selected_locks[n] = selected_locks[i];
+                selected_ports[n++] = mask;
+            } else {
+                if (selected_locks)
+                    unlock_relay(selected_locks[i]);
+                uhid_close(selected[i]);
+            }
+        }
+        selected_count = n;
+    }
+    free(list.specs);
+    free(found);
+    uhid_ports_free(ports);
+    uhid_ports_free(other);
+    return rc < 0 ? -1 : selected_count;
+}
+
+
+/*
+ * Select relays by USB location, comma separated list.
+ * Only these relays are opened, other relays are never touched.
+ * Returns count of selected relays, or -1 if some relay was not found.
+ */
+
+static int select_locations(const char* text)
+{
+    const char* position = text;
+    struct uhid_relay* relay;
+    char location[64];
+    int rc = 0;
+    int i;
+
+    release_selected();
+    while (next_token(&position, location, sizeof(location))) {
+        relay = uhid_open_location(ctx, location);
+        if (!relay) {
+            if (errno == EINVAL)
+                fprintf(stderr, "Invalid USB location %s!\n", location);
+            else if (errno == ENOSYS)
+                fprintf(stderr, "USB locations are not supported on this platform!\n");
+            else
+                fprintf(stderr, "No relay at USB location %s!\n", location);
+            rc = -1;
+            continue;
+        }
+        for (i = 0; i < selected_count && selected[i] != relay; i++)
+            ;
+        if (i < selected_count) {
+            /* same relay listed twice */
+            uhid_close(relay);
+            continue;
+        }
+        selected = realloc(selected, (selected_count + 1) * sizeof(*selected));
+        selected_ports = realloc(selected_ports, (selected_count + 1) * sizeof(*selected_ports));
+        if (!selected || !selected_ports) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        selected[selected_count] = relay;
+        selected_ports[selected_count++] = opt_ports;
+    }
+    if (rc < 0 || selected_count == 0) {
+        release_selected();
         return -1;
-    rc = hid_write(handle, buf, sizeof(buf));
-    hid_close(handle);
-    return rc;
+    }
+    return selected_count;
 }
 
 
@@ -302,33 +990,23 @@ static int set_port_state(struct relay_info* info, int port, int state)
  * Returns 0 on success, -1 if error occured.
  */
 
-static int set_serial(struct relay_info* info, char* newserial)
+static int set_serial(struct uhid_relay* relay, char* newserial)
 {
-    int rc = -1;
-    hid_device *handle;
-    unsigned char buf[9] = {0, 0xFA};
-    if (strlen(newserial) > 5) {
-        fprintf(stderr, "New serial number %s length must be <=5!\n", newserial);
+    char oldserial[16];
+    if (strlen(newserial) > UHID_SERIAL_LEN) {
+        fprintf(stderr, "New serial number %s length must be <=%d!\n", newserial, UHID_SERIAL_LEN);
         return -1;
     }
+    snprintf(oldserial, sizeof(oldserial), "%s", uhid_relay_serial(relay));
     /* Check if serial number is already what is requested: */
-    if (!strcmp(info->serial, newserial)) {
-        printf("Relay %s is already renamed to %s\n", relays[0].serial, opt_newserial);
+    if (!strcmp(oldserial, newserial)) {
+        printf("Relay %s is already renamed to %s\n", oldserial, newserial);
         return 0;
     }
-    strncpy((char *) buf+2, newserial, sizeof(buf) - 2);
-    if (!info)
+    if (uhid_set_serial(relay, newserial) < 0)
         return -1;
-    handle = hid_open_path(info->path);
-    if (!handle)
-        return -1;
-    rc = hid_write(handle, buf, sizeof(buf));
-    hid_close(handle);
-    if (rc > 0) {
-        printf("Relay %s has been renamed to %s\n", relays[0].serial, opt_newserial);
-        return 0;
-    }
-    return -1;
+    printf("Relay %s has been renamed to %s\n", oldserial, newserial);
+    return 0;
 }
 
 
@@ -337,32 +1015,2268 @@ static int set_serial(struct relay_info* info, char* newserial)
  * If portmask is 0, show all ports.
  */
 
-static int print_relay_status(struct relay_info* info, int portmask)
+static void print_ports(struct uhid_relay* relay, uint32_t portmask, uint32_t bitmap)
 {
     int port;
     int state;
-    if (!info)
-        return -1;
-    printf("Status for relay %s, %d ports:\n", info->serial, info->nports);
-    for (port = 1; port <= info->nports; port++) {
-        if (portmask > 0 && (portmask & (1 << (port-1))) == 0)
+    for (port = 1; port <= uhid_relay_nports(relay); port++) {
+        if (portmask > 0 && (portmask & UHID_PORT_BIT(port)) == 0)
             continue;
-        state = get_port_state(info, port);
+        state = (bitmap & UHID_PORT_BIT(port)) ? 1 : 0;
         printf("  Port %d: %d %s\n", port, state, state ? "ON" : "OFF");
     }
-    return 0;
 }
 
 
-int main(int argc, char *argv[])
+static int print_relay_status(struct uhid_relay* relay, uint32_t portmask)
 {
+    uint32_t bitmap;
+    if (!relay)
+        return -1;
+    printf("Status for relay %s, %d ports:\n", uhid_relay_serial(relay), uhid_relay_nports(relay));
+    if (uhid_get_bitmap(relay, &bitmap) < 0) {
+        fprintf(stderr, "Cannot read relay %s state!\n", uhid_relay_serial(relay));
+        return -1;
+    }
+    print_ports(relay, portmask, bitmap);
+    return 0;
+}
+
+
+/*
+ * Format ports bitmap as port list, e.g. 1,3-5.
+ */
+
+static char* bitmap2ports(uint32_t bitmap, char* buf, size_t size)
+{
+    size_t len = 0;
+    int first;
+    int port;
+    buf[0] = 0;
+    for (port = 1; port <= UHID_MAX_PORTS && len < size; port++) {
+        if (!(bitmap & UHID_PORT_BIT(port)))
+            continue;
+        for (first = port; port < UHID_MAX_PORTS && (bitmap & UHID_PORT_BIT(port + 1)); port++)
+            ;
+        if (first == port)
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", port);
+        else
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", first, port);
+    }
+    return buf;
+}
+
+
+/*
+ * Bitmask of ports present on relay.
+ */
+
+static uint32_t relay_ports(struct uhid_relay* relay)
+{
+    int nports = uhid_relay_nports(relay);
+    return nports >= UHID_MAX_PORTS ? UHID_ALL_PORTS : UHID_PORT_BIT(nports + 1) - 1;
+}
+
+
+/*
+ * Machine readable output of relay state, see output_relay().
+ * Every relay is formatted in buffer and written (and flushed) at once,
+ * so consumers can parse output while it streams.
+ */
+#define OUTPUT_MAX    2048
+
+struct output {
+    char buf[OUTPUT_MAX];
+    size_t len;
+};
+
+static int output_started = 0;
+static int output_count = 0;             /* relays written */
+
+
+static void output_printf(struct output* out, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+    if (out->len >= sizeof(out->buf))
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out->len += n;
+}
+
+
+static void output_json_string(struct output* out, const char* str)
+{
+    output_printf(out, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            output_printf(out, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            output_printf(out, "\\u%04x", (unsigned char)*str);
+        else
+            output_printf(out, "%c", *str);
+    }
+    output_printf(out, "\"");
+}
+
+
+static void output_csv_string(struct output* out, const char* str)
+{
+    if (!strpbrk(str, ",\"\r\n")) {
+        output_printf(out, "%s", str);
+        return;
+    }
+    output_printf(out, "\"");
+    for (; *str; str++) {
+        output_printf(out, *str == '"' ? "\"\"" : "%c", *str);
+    }
+    output_printf(out, "\"");
+}
+
+
+/* Start output of relays: CSV header, or JSON array */
+
+static void output_begin(void)
+{
+    if (output_started)
+        return;
+    output_started = 1;
+    if (opt_format == FORMAT_JSON)
+        printf("[");
+    else if (opt_format == FORMAT_CSV)
+        printf("serial,path,nports,bitmap,on,off,latency_ms,error\n");
+    fflush(stdout);
+}
+
+
+static void output_end(void)
+{
+    if (output_started && opt_format == FORMAT_JSON)
+        printf("%s]\n", output_count ? "\n" : "");
+    output_started = 0;
+}
+
+
+/*
+ * Write state of relay ports in portmask, or error if relay failed (rc < 0).
+ * latency is time of operation which got that state, in milliseconds;
+ * relays are read and written in batches, so it is latency of whole batch.
+ */
+
+static void output_relay(struct uhid_relay* relay, uint32_t portmask, uint32_t bitmap,
+                         int rc, double latency)
+{
+    struct output out;
+    char on[128];
+    char off[128];
+    int port;
+    int n = 0;
+
+    portmask &= relay_ports(relay);
+    bitmap &= relay_ports(relay);
+    if (opt_format == FORMAT_TEXT) {
+        printf("Status for relay %s, %d ports:\n", uhid_relay_serial(relay), uhid_relay_nports(relay));
+        if (rc < 0)
+            fprintf(stderr, "Cannot read relay %s state!\n", uhid_relay_serial(relay));
+        else
+            print_ports(relay, portmask, bitmap);
+        return;
+    }
+    output_begin();
+    out.len = 0;
+    if (opt_format == FORMAT_CSV) {
+        output_csv_string(&out, uhid_relay_serial(relay));
+        output_printf(&out, ",");
+        output_csv_string(&out, uhid_relay_path(relay));
+        output_printf(&out, ",%d,", uhid_relay_nports(relay));
+        if (rc == 0) {
+            output_printf(&out, "%u,", bitmap);
+            output_csv_string(&out, bitmap2ports(bitmap & portmask, on, sizeof(on)));
+            output_printf(&out, ",");
+            output_csv_string(&out, bitmap2ports(~bitmap & portmask, off, sizeof(off)));
+            output_printf(&out, ",%.3f,\n", latency);
+        } else {
+            output_printf(&out, ",,,%.3f,cannot read state\n", latency);
+        }
+    } else {
+        output_printf(&out, "%s{\"serial\":", opt_format == FORMAT_JSON ? (output_count ? ",\n" : "\n") : "");
+        output_json_string(&out, uhid_relay_serial(relay));
+        output_printf(&out, ",\"path\":");
+        output_json_string(&out, uhid_relay_path(relay));
+        output_printf(&out, ",\"nports\":%d", uhid_relay_nports(relay));
+        if (rc == 0) {
+            output_printf(&out, ",\"bitmap\":%u,\"ports\":{", bitmap);
+            for (port = 1; port <= uhid_relay_nports(relay); port++) {
+                if (portmask & UHID_PORT_BIT(port))
+                    output_printf(&out, "%s\"%d\":%d", n++ ? "," : "", port,
+                                  (bitmap & UHID_PORT_BIT(port)) ? 1 : 0);
+            }
+            output_printf(&out, "}");
+        } else {
+            output_printf(&out, ",\"error\":\"cannot read state\"");
+        }
+        output_printf(&out, ",\"latency_ms\":%.3f}%s", latency, opt_format == FORMAT_JSONL ? "\n" : "");
+    }
+    fwrite(out.buf, 1, out.len, stdout);
+    fflush(stdout);
+    output_count++;
+}
+
+
+/*
+ * Plan of all actions for selected relays, indexed like selected[]:
+ * phase 0 sets masks[0] ports to values[0], then after delay,
+ * phase 1 turns masks[1] (cycled) ports back on.
+ */
+struct action_plan {
+    uint32_t* masks[2];
+    uint32_t* values[2];
+    int cycle;          /* some ports are cycled */
+};
+
+
+static void action_plan_free(struct action_plan* plan)
+{
+    free(plan->masks[0]);
+    free(plan->masks[1]);
+    free(plan->values[0]);
+}
+
+
+/*
+ * Ports of relay-qualified port list for every selected relay.
+ */
+
+static void relay_masks(const char* relay_ports, uint32_t* masks)
+{
+    struct port_list list = { NULL, 0, 0, -1 };
+    struct uhid_relay** found;
+    int max = uhid_max_id(ctx);
+    int* index;   /* by relay id: position in selected[] + 1 */
+    int count;
+    int i, k;
+
+    found = malloc((max + 1) * sizeof(*found));
+    index = calloc(max + 1, sizeof(*index));
+    if (!found || !index) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    for (i = 0; i < selected_count; i++) {
+        masks[i] = 0;
+        index[uhid_relay_id(selected[i])] = i + 1;
+    }
+    compile_port_list(&list, relay_ports, 1); /* already checked by select_relays() */
+    for (k = 0; k < list.count; k++) {
+        count = uhid_find(ctx, list.specs[k].serial, found, max);
+        for (i = 0; i < count && i < max; i++) {
+            if (index[uhid_relay_id(found[i])])
+                masks[index[uhid_relay_id(found[i])] - 1] |= list.specs[k].ports;
+            uhid_close(found[i]);
+        }
+    }
+    free(list.specs);
+    free(found);
+    free(index);
+}
+
+
+/*
+ * Compile all actions from command line into plan, later actions
+ * override earlier ones for same port.  With single action, ports
+ * are those selected with relays, otherwise ports of every action are
+ * limited to selected ports.  Ports of selected relays are set
+ * to all ports affected by plan.
+ */
+
+static void compile_actions(struct action_plan* plan)
+{
+    uint32_t* masks;
+    uint32_t m;
+    int single = (actions_count == 1);
+    int i, j;
+
+    plan->masks[0]  = calloc(selected_count + 1, sizeof(uint32_t));
+    plan->masks[1]  = calloc(selected_count + 1, sizeof(uint32_t));
+    plan->values[0] = calloc(selected_count + 1, sizeof(uint32_t));
+    masks = malloc((selected_count + 1) * sizeof(*masks));
+    if (!plan->masks[0] || !plan->masks[1] || !plan->values[0] || !masks) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    plan->values[1] = plan->masks[1];
+    plan->cycle = 0;
+    for (j = 0; j < actions_count; j++) {
+        const struct port_arg* arg = &port_args[port_args_count > 1 ? j : 0];
+        if (single || port_args_count == 0)
+            memcpy(masks, selected_ports, selected_count * sizeof(*masks));
+        else if (arg->relay_ports)
+            relay_masks(arg->relay_ports, masks);
+        else
+            for (i = 0; i < selected_count; i++)
+                masks[i] = arg->ports;
+        for (i = 0; i < selected_count; i++) {
+            m = masks[i] & selected_ports[i];
+            plan->masks[0][i] |= m;
+            if (actions[j] == POWER_ON)
+                plan->values[0][i] |= m;
+            else
+                plan->values[0][i] &= ~m;
+            if (actions[j] == POWER_CYCLE)
+                plan->masks[1][i] |= m;
+            else
+                plan->masks[1][i] &= ~m;
+        }
+        plan->cycle |= (actions[j] == POWER_CYCLE);
+    }
+    for (i = 0; i < selected_count; i++) {
+        selected_ports[i] = plan->masks[0][i];
+    }
+    free(masks);
+}
+
+
+/*
+ * Audit log: append-only file of fixed size binary records (native byte
+ * order) after header, one record per operation which changed relay ports.
+ * Records are buffered and appended together, with fsync, when buffer fills up
+ * or AUDIT_FLUSH_MS after first of them was made, under exclusive lock
+ * of log, so processes sharing log never interleave their records.
+ * Sparse index FILE.idx has time and number of every AUDIT_INDEX_EVERY-th record.
+ */
+#define AUDIT_MAGIC        "UHIDAUD1"
+#define AUDIT_BUFFER       256         /* records */
+#define AUDIT_FLUSH_MS     1000
+#define AUDIT_INDEX_EVERY  1024
+
+/*
+ * Records are appended in order of flushes, not of their time: record may
+ * be appended after records made up to this much later (up to two flush
+ * intervals, with generous margin for slow fsync), which query allows for.
+ */
+#define AUDIT_SKEW_US      (10 * 1000000ULL)
+
+#define AUDIT_CYCLE        1   /* ports were cycled */
+#define AUDIT_ROLLBACK     2   /* ports were restored after failed change */
+#define AUDIT_FAILED       4   /* change failed, new state may be wrong */
+#define AUDIT_UNKNOWN      8   /* state before change was not known */
+
+struct audit_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t index_every;
+};
+
+struct audit_record {
+    uint64_t time;                       /* microseconds since epoch */
+    char serial[6];                      /* relay serial number */
+    uint16_t flags;                      /* AUDIT_xxx */
+    uint32_t mask;                       /* ports operated on */
+    uint32_t old_state;
+    uint32_t new_state;
+    uint32_t uid;                        /* caller user and process id, -1 if unknown */
+    uint32_t pid;
+    uint32_t latency;                    /* microseconds */
+};
+
+struct audit_index {
+    uint64_t time;                       /* time of record */
+    uint64_t number;                     /* record number, from 0 */
+};
+
+static int audit_fd = -1;
+static int audit_index_fd = -1;
+static struct audit_record audit_buf[AUDIT_BUFFER];
+static struct audit_record audit_out[AUDIT_BUFFER];
+static int audit_count = 0;
+static double audit_first = 0;           /* when first buffered record was made, ms */
+static pthread_mutex_t audit_lock = PTHREAD_MUTEX_INITIALIZER;       /* audit_buf */
+static pthread_mutex_t audit_flush_lock = PTHREAD_MUTEX_INITIALIZER; /* audit_out and files */
+
+
+/* wall clock, in microseconds since epoch */
+
+static uint64_t wall_us(void)
+{
+#if defined(_WIN32)
+    FILETIME ft;
+    ULARGE_INTEGER t;
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    return (t.QuadPart - 116444736000000000ULL) / 10;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+
+#if !defined(_WIN32)
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    ssize_t n;
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static void audit_file_lock(int operation)
+{
+    while (flock(audit_fd, operation) < 0 && errno == EINTR)
+        ;
+}
+
+
+/*
+ * Open audit log and its index, creating them if needed.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int audit_open(const char* path)
+{
+    struct audit_header header;
+    char name[1024];
+    struct stat st;
+    int rc = 0;
+
+    if (snprintf(name, sizeof(name), "%s.idx", path) >= (int)sizeof(name)) {
+        fprintf(stderr, "File name %s is too long!\n", path);
+        return -1;
+    }
+    audit_fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+    audit_index_fd = open(name, O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (audit_fd < 0 || audit_index_fd < 0) {
+        perror(audit_fd < 0 ? path : name);
+        return -1;
+    }
+    audit_file_lock(LOCK_EX);
+    if (fstat(audit_fd, &st) < 0) {
+        perror(path);
+        rc = -1;
+    } else if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, AUDIT_MAGIC, sizeof(header.magic));
+        header.record_size = sizeof(struct audit_record);
+        header.index_every = AUDIT_INDEX_EVERY;
+        if (write_all(audit_fd, &header, sizeof(header)) < 0) {
+            perror(path);
+            rc = -1;
+        }
+    } else if (pread(audit_fd, &header, sizeof(header), 0) != sizeof(header) ||
+               memcmp(header.magic, AUDIT_MAGIC, sizeof(header.magic)) ||
+               header.record_size != sizeof(struct audit_record)) {
+        fprintf(stderr, "%s is not uhidctl audit log!\n", path);
+        rc = -1;
+    }
+    audit_file_lock(LOCK_UN);
+    return rc;
+}
+
+
+/*
+ * Append buffered records to audit log, and index entries for them.
+ * Errors are reported, and records are dropped: relays are still controlled.
+ */
+
+static void audit_flush(void)
+{
+    struct audit_index entry;
+    struct stat st;
+    uint64_t first = 0;
+    off_t size;
+    int count;
+    int i;
+
+    if (audit_fd < 0)
+        return;
+    pthread_mutex_lock(&audit_flush_lock);
+    pthread_mutex_lock(&audit_lock);
+    count = audit_count;
+    memcpy(audit_out, audit_buf, count * sizeof(*audit_out));
+    audit_count = 0;
+    pthread_mutex_unlock(&audit_lock);
+    if (count > 0) {
+        audit_file_lock(LOCK_EX);
+        /* Partial record or entry left by writer which crashed is dropped */
+        if (fstat(audit_fd, &st) == 0) {
+            first = (st.st_size - sizeof(struct audit_header)) / sizeof(struct audit_record);
+            size = sizeof(struct audit_header) + first * sizeof(struct audit_record);
+            if (size != st.st_size && ftruncate(audit_fd, size) < 0)
+                perror("Cannot repair audit log");
+        }
+        if (fstat(audit_index_fd, &st) == 0 && st.st_size % sizeof(entry) &&
+            ftruncate(audit_index_fd, st.st_size - st.st_size % sizeof(entry)) < 0)
+            perror("Cannot repair audit index");
+        if (write_all(audit_fd, audit_out, count * sizeof(*audit_out)) < 0) {
+            perror("Cannot write audit log");
+        } else {
+            for (i = 0; i < count; i++) {
+                if ((first + i) % AUDIT_INDEX_EVERY)
+                    continue;
+                entry.time = audit_out[i].time;
+                entry.number = first + i;
+                if (write_all(audit_index_fd, &entry, sizeof(entry)) < 0)
+                    perror("Cannot write audit index");
+            }
+            if (fsync(audit_fd) < 0 || fsync(audit_index_fd) < 0)
+                perror("Cannot sync audit log");
+        }
+        audit_file_lock(LOCK_UN);
+    }
+    pthread_mutex_unlock(&audit_flush_lock);
+}
+
+#else
+
+static int audit_open(const char* path)
+{
+    fprintf(stderr, "Audit log %s is not supported on this platform!\n", path);
+    return -1;
+}
+
+static void audit_flush(void)
+{
+}
+
+#endif /* !_WIN32 */
+
+
+/*
+ * Add record to audit log buffer, flushing it if it is full or old enough.
+ * latency is in milliseconds.
+ */
+
+static void audit_add(struct uhid_relay* relay, uint32_t mask, uint32_t old_state,
+                      uint32_t new_state, int flags, uint32_t uid, uint32_t pid, double latency)
+{
+    struct audit_record* r;
+    double now;
+    int flush;
+
+    if (audit_fd < 0)
+        return;
+    now = now_ms();
+    pthread_mutex_lock(&audit_lock);
+    while (audit_count == AUDIT_BUFFER) {
+        pthread_mutex_unlock(&audit_lock);
+        audit_flush();
+        pthread_mutex_lock(&audit_lock);
+    }
+    if (audit_count == 0)
+        audit_first = now;
+    r = &audit_buf[audit_count++];
+    memset(r, 0, sizeof(*r));
+    r->time = wall_us();
+    strncpy(r->serial, uhid_relay_serial(relay), sizeof(r->serial));
+    r->flags = flags;
+    r->mask = mask;
+    r->old_state = old_state;
+    r->new_state = new_state;
+    r->uid = uid;
+    r->pid = pid;
+    r->latency = latency * 1000;
+    flush = audit_count == AUDIT_BUFFER || now - audit_first >= AUDIT_FLUSH_MS;
+    pthread_mutex_unlock(&audit_lock);
+    if (flush)
+        audit_flush();
+}
+
+
+/*
+ * Milliseconds until buffered records must be flushed with audit_flush(),
+ * or timeout (-1 for infinite), whichever is sooner.  For poll() loops:
+ * while buffer is empty, it is AUDIT_FLUSH_MS, records may come meanwhile.
+ */
+
+static int audit_timeout(int timeout)
+{
+    int left = AUDIT_FLUSH_MS;
+    if (audit_fd < 0)
+        return timeout;
+    pthread_mutex_lock(&audit_lock);
+    if (audit_count > 0) {
+        left = (int)(audit_first + AUDIT_FLUSH_MS - now_ms());
+        if (left < 0)
+            left = 0;
+    }
+    pthread_mutex_unlock(&audit_lock);
+    return (timeout < 0 || left < timeout) ? left : timeout;
+}
+
+
+static void audit_close(void)
+{
+    audit_flush();
+#if !defined(_WIN32)
+    if (audit_fd >= 0)
+        close(audit_fd);
+    if (audit_index_fd >= 0)
+        close(audit_index_fd);
+#endif
+    audit_fd = audit_index_fd = -1;
+}
+
+
+/* Caller of operations made by this process, for audit log */
+
+static uint32_t caller_uid(void)
+{
+#if defined(_WIN32)
+    return (uint32_t)-1;
+#else
+    return getuid();
+#endif
+}
+
+
+static uint32_t caller_pid(void)
+{
+    return getpid();
+}
+
+
+#if !defined(_WIN32)
+
+/*
+ * Parse time for audit query: seconds since epoch,
+ * or local time YYYY-MM-DD[ HH:MM[:SS]] (T may separate date and time).
+ * Returns microseconds since epoch, or 0 if time is bad.
+ */
+
+static uint64_t parse_audit_time(const char* str)
+{
+    static const char* const formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d"
+    };
+    struct tm tm;
+    const char* end;
+    char* stop;
+    double seconds;
+    size_t i;
+
+    seconds = strtod(str, &stop);
+    if (stop != str && *stop == 0)
+        return seconds > 0 ? (uint64_t)(seconds * 1000000) : 0;
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(str, formats[i], &tm);
+        if (end && *end == 0) {
+            tm.tm_isdst = -1;
+            return (uint64_t)mktime(&tm) * 1000000;
+        }
+    }
+    return 0;
+}
+
+
+/* Relay serial is in comma separated list, or list is NULL */
+
+static int serial_listed(const char* serial, const char* list)
+{
+    size_t len = strlen(serial);
+    const char* p;
+    if (!list)
+        return 1;
+    for (p = list; *p; p += strcspn(p, ",")) {
+        if (*p == ',')
+            p++;
+        if (!strncasecmp(p, serial, len) && (p[len] == ',' || p[len] == 0))
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Print records of audit log made in time range FROM[,TO], for relays
+ * in comma separated list (all relays if NULL).  Index finds record
+ * to start reading from, and reading stops soon after range ends.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int audit_query(const char* path, const char* range, const char* relays)
+{
+    struct audit_header header;
+    struct audit_record records[AUDIT_BUFFER];
+    struct audit_index entry;
+    char name[1024];
+    char from_str[64];
+    char ports[128];
+    char when[32];
+    uint64_t from, to;
+    uint64_t start = 0;
+    const char* comma;
+    struct tm tm;
+    time_t t;
+    FILE* log;
+    FILE* index;
+    size_t n;
+    size_t i;
+    int found = 0;
+
+    comma = strchr(range, ',');
+    snprintf(from_str, sizeof(from_str), "%.*s", comma ? (int)(comma - range) : (int)strlen(range), range);
+    from = parse_audit_time(from_str);
+    to = comma ? parse_audit_time(comma + 1) : UINT64_MAX - AUDIT_SKEW_US;
+    if (!from || !to || to < from) {
+        fprintf(stderr, "Invalid time range: %s. Run with -h to get usage info.\n", range);
+        return -1;
+    }
+    log = fopen(path, "rb");
+    if (!log) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, log) != 1 ||
+        memcmp(header.magic, AUDIT_MAGIC, sizeof(header.magic)) ||
+        header.record_size != sizeof(struct audit_record)) {
+        fprintf(stderr, "%s is not uhidctl audit log!\n", path);
+        fclose(log);
+        return -1;
+    }
+    /* Records before indexed one are at most AUDIT_SKEW_US newer than it */
+    snprintf(name, sizeof(name), "%s.idx", path);
+    index = fopen(name, "rb");
+    while (index && fread(&entry, sizeof(entry), 1, index) == 1 && entry.time + AUDIT_SKEW_US < from) {
+        start = entry.number;
+    }
+    if (index)
+        fclose(index);
+    if (fseek(log, sizeof(header) + start * sizeof(struct audit_record), SEEK_SET) < 0) {
+        perror(path);
+        fclose(log);
+        return -1;
+    }
+    /* Records after one made after range are at most AUDIT_SKEW_US older than it */
+    while ((n = fread(records, sizeof(records[0]), AUDIT_BUFFER, log)) > 0) {
+        for (i = 0; i < n; i++) {
+            struct audit_record* r = &records[i];
+            char serial[sizeof(r->serial) + 1];
+            if (r->time > to + AUDIT_SKEW_US)
+                break;
+            memcpy(serial, r->serial, sizeof(r->serial));
+            serial[sizeof(r->serial)] = 0;
+            if (r->time < from || r->time > to || !serial_listed(serial, relays))
+                continue;
+            t = r->time / 1000000;
+            localtime_r(&t, &tm);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+            printf("%s.%06u %-5s ports %s %x -> %x uid %d pid %d %.2f ms%s%s%s%s\n",
+                when, (unsigned)(r->time % 1000000), serial,
+                r->mask ? bitmap2ports(r->mask, ports, sizeof(ports)) : "none",
+                r->old_state, r->new_state,
+                (int)r->uid, (int)r->pid, r->latency / 1000.0,
+                (r->flags & AUDIT_CYCLE)    ? " cycle" : "",
+                (r->flags & AUDIT_ROLLBACK) ? " rollback" : "",
+                (r->flags & AUDIT_FAILED)   ? " FAILED" : "",
+                (r->flags & AUDIT_UNKNOWN)  ? " (old state unknown)" : "");
+            found++;
+        }
+        if (i < n)
+            break;
+    }
+    fclose(log);
+    printf("%d record(s) found\n", found);
+    return 0;
+}
+
+#else
+
+static int audit_query(const char* path, const char* range, const char* relays)
+{
+    (void)range;
+    (void)relays;
+    fprintf(stderr, "Audit log %s is not supported on this platform!\n", path);
+    return -1;
+}
+
+#endif /* !_WIN32 */
+
+
+/*
+ * Switch relay ports for daemon or interactive command made by caller,
+ * and record it in audit log (reading relay state before, if log is open).
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int switch_relay(struct uhid_relay* relay, int action, uint32_t mask, double delay,
+                        uint32_t* result, uint32_t uid, uint32_t pid)
+{
+    uint32_t old_state = 0;
+    int flags = action == POWER_CYCLE ? AUDIT_CYCLE : 0;
+    double started;
+    int rc;
+
+    if (audit_fd >= 0 && uhid_get_bitmap(relay, &old_state) < 0)
+        flags |= AUDIT_UNKNOWN;
+    started = now_ms();
+    if (action == POWER_CYCLE)
+        rc = uhid_cycle(relay, mask, delay, result);
+    else
+        rc = uhid_set_bitmap(relay, mask, action == POWER_ON ? mask : 0, result);
+    audit_add(relay, mask & relay_ports(relay), old_state, *result,
+        flags | (rc < 0 ? AUDIT_FAILED : 0), uid, pid, now_ms() - started);
+    return rc;
+}
+
+
+/*
+ * Transaction state: selected relays as they were before any change,
+ * and scratch arrays, all indexed like selected[].
+ */
+struct transaction {
+    uint32_t* snapshot;
+    uint32_t* masks;
+    uint32_t* values;
+    uint32_t* current;
+    int* failed;
+    int* known;         /* current state was read */
+    uint32_t* before;   /* state before last change, for audit log */
+    int* before_known;
+    double latency;     /* of last change, ms */
+    struct uhid_relay** relays;
+};
+
+
+static void transaction_free(struct transaction* tx)
+{
+    free(tx->snapshot);
+    free(tx->masks);
+    free(tx->values);
+    free(tx->current);
+    free(tx->failed);
+    free(tx->known);
+    free(tx->before);
+    free(tx->before_known);
+    free(tx->relays);
+}
+
+
+/*
+ * Snapshot state of all selected relays, with one read per relay.
+ * Returns 0 on success, -1 if some relay could not be read.
+ */
+
+static int transaction_begin(struct transaction* tx)
+{
+    size_t n = selected_count + 1;
+    int rc;
+    int i;
+    tx->snapshot = malloc(n * sizeof(*tx->snapshot));
+    tx->masks    = malloc(n * sizeof(*tx->masks));
+    tx->values   = malloc(n * sizeof(*tx->values));
+    tx->current  = malloc(n * sizeof(*tx->current));
+    tx->failed   = malloc(n * sizeof(*tx->failed));
+    tx->known    = malloc(n * sizeof(*tx->known));
+    tx->before   = malloc(n * sizeof(*tx->before));
+    tx->before_known = malloc(n * sizeof(*tx->before_known));
+    tx->relays   = malloc(n * sizeof(*tx->relays));
+    if (!tx->snapshot || !tx->masks || !tx->values || !tx->current ||
+        !tx->failed || !tx->known || !tx->before || !tx->before_known || !tx->relays) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    rc = uhid_get_bitmaps(selected, selected_count, tx->snapshot, tx->failed);
+    for (i = 0; i < selected_count; i++) {
+        if (tx->failed[i])
+            fprintf(stderr, "Cannot read relay %s state!\n", uhid_relay_serial(selected[i]));
+        tx->current[i] = tx->snapshot[i];
+        tx->known[i] = !tx->failed[i];
+    }
+    return rc;
+}
+
+
+/*
+ * Restore every relay changed by transaction to its snapshot.
+ * Only ports that differ from snapshot are written.
+ * Reports what was rolled back.
+ */
+
+static void transaction_rollback(struct transaction* tx)
+{
+    char buf[128];
+    uint32_t changed;
+    double started;
+    double latency;
+    int count = 0;
+    int i, k;
+
+    /* Relays which kept snapshot state are not touched at all */
+    for (i = 0; i < selected_count; i++) {
+        uint32_t mask = selected_ports[i] & relay_ports(selected[i]);
+        if (tx->known[i] && ((tx->current[i] ^ tx->snapshot[i]) & mask) == 0)
+            continue;
+        tx->relays[count] = selected[i];
+        tx->masks[count]  = mask;
+        tx->values[count] = tx->snapshot[i];
+        count++;
+    }
+    fprintf(stderr, "Rolling back %d relay(s):\n", count);
+    started = now_ms();
+    uhid_apply_bitmaps(tx->relays, count, tx->masks, tx->values, tx->failed);
+    latency = now_ms() - started;
+    for (i = 0, k = 0; i < selected_count && k < count; i++) {
+        if (selected[i] != tx->relays[k])
+            continue;
+        audit_add(selected[i], tx->masks[k], tx->current[i],
+            (tx->current[i] & ~tx->masks[k]) | (tx->snapshot[i] & tx->masks[k]),
+            AUDIT_ROLLBACK | (tx->failed[k] ? AUDIT_FAILED : 0) | (tx->known[i] ? 0 : AUDIT_UNKNOWN),
+            caller_uid(), caller_pid(), latency);
+        if (tx->failed[k]) {
+            fprintf(stderr, "  %s: rollback FAILED\n", uhid_relay_serial(selected[i]));
+        } else if (tx->known[i]) {
+            changed = (tx->current[i] ^ tx->snapshot[i]) & tx->masks[k];
+            fprintf(stderr, "  %s: ports %s restored to %s\n", uhid_relay_serial(selected[i]),
+                bitmap2ports(changed, buf, sizeof(buf)),
+                (tx->snapshot[i] & changed) == changed ? "ON" :
+                (tx->snapshot[i] & changed) == 0 ? "OFF" : "previous state");
+        } else {
+            fprintf(stderr, "  %s: ports %s restored (state was unknown)\n",
+                uhid_relay_serial(selected[i]), bitmap2ports(tx->masks[k], buf, sizeof(buf)));
+        }
+        k++;
+    }
+    audit_flush();
+}
+
+
+/*
+ * Set ports given by masks[] to values[] on all selected relays at once,
+ * then read relays back to verify that every port got its new state.
+ * cycled[] has ports being cycled (or is NULL), for audit log, which gets
+ * record of every relay that changed or failed.
+ * Returns 0 on success, -1 if any relay failed.
+ */
+
+static int set_relays_state(struct transaction* tx, const uint32_t* masks, const uint32_t* values,
+                            const uint32_t* cycled)
+{
+    char buf[128];
+    double started;
+    double latency;
+    int rc = 0;
+    int i;
+
+    for (i = 0; i < selected_count; i++) {
+        tx->before[i] = tx->current[i];
+        tx->before_known[i] = tx->known[i];
+    }
+    started = now_ms();
+    uhid_apply_bitmaps(selected, selected_count, masks, values, tx->failed);
+    latency = now_ms() - started;
+    tx->latency = latency;
+    /* Failed writes leave relay state unknown, read all of them back */
+    for (i = 0; i < selected_count; i++) {
+        tx->known[i] = !tx->failed[i];
+    }
+    uhid_get_bitmaps(selected, selected_count, tx->current, tx->failed);
+    for (i = 0; i < selected_count; i++) {
+        uint32_t mask = masks[i] & relay_ports(selected[i]);
+        int flags = tx->before_known[i] ? 0 : AUDIT_UNKNOWN;
+        if (tx->failed[i]) {
+            fprintf(stderr, "Cannot read relay %s state!\n", uhid_relay_serial(selected[i]));
+            tx->known[i] = 0;
+            flags |= AUDIT_FAILED;
+            rc = -1;
+        } else if (!tx->known[i]) {
+            fprintf(stderr, "Cannot set relay %s state!\n", uhid_relay_serial(selected[i]));
+            tx->known[i] = 1;
+            flags |= AUDIT_FAILED;
+            rc = -1;
+        } else if ((tx->current[i] ^ values[i]) & mask) {
+            fprintf(stderr, "Relay %s did not switch ports %s!\n", uhid_relay_serial(selected[i]),
+                bitmap2ports((tx->current[i] ^ values[i]) & mask, buf, sizeof(buf)));
+            flags |= AUDIT_FAILED;
+            rc = -1;
+        }
+        if (!(flags & (AUDIT_FAILED | AUDIT_UNKNOWN)) && tx->before[i] == tx->current[i])
+            continue;
+        if (cycled && (cycled[i] & mask))
+            flags |= AUDIT_CYCLE;
+        audit_add(selected[i], mask, tx->before[i], tx->current[i], flags,
+            caller_uid(), caller_pid(), latency);
+    }
+    /* Records are not kept waiting while cycled ports are off */
+    audit_flush();
+    return rc;
+}
+
+
+/*
+ * State file has one line per relay: serial number, bitmap of saved ports
+ * and their state, both in hex, e.g. "ABCDE ff 0d".
+ */
+
+#define STATE_HEADER  "# uhidctl state v1\n"
+
+
+/*
+ * Files written by uhidctl are created as temporary file next to path,
+ * and renamed over path only when complete.
+ * Returns temporary file, or NULL if it cannot be created.
+ */
+
+static FILE* create_file(const char* path, char* tmp, size_t size)
+{
+    FILE* f;
+    if (snprintf(tmp, size, "%s.tmp", path) >= (int)size) {
+        fprintf(stderr, "File name %s is too long!\n", path);
+        return NULL;
+    }
+    f = fopen(tmp, "w");
+    if (!f)
+        perror(tmp);
+    return f;
+}
+
+
+/*
+ * Close file from create_file() and move it to path.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int commit_file(FILE* f, const char* path, const char* tmp)
+{
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Save state of selected relays, all read in parallel.
+ * File is replaced atomically, only after all relays were read.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int save_state(const char* path)
+{
+    char tmp[1024];
+    uint32_t* bitmaps;
+    int* failed;
+    FILE* f;
+    int rc = 0;
+    int i;
+
+    bitmaps = malloc((selected_count + 1) * sizeof(*bitmaps));
+    failed  = malloc((selected_count + 1) * sizeof(*failed));
+    if (!bitmaps || !failed) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    for (i = 0; i < selected_count; i++) {
+        /* File is keyed by serial, so it must identify relay */
+        if (uhid_find(ctx, uhid_relay_serial(selected[i]), NULL, 0) > 1) {
+            fprintf(stderr, "More than 1 relay has serial %s, assign unique serial with -s!\n",
+                uhid_relay_serial(selected[i]));
+            rc = -1;
+        }
+    }
+    if (rc == 0 && uhid_get_bitmaps(selected, selected_count, bitmaps, failed) < 0) {
+        for (i = 0; i < selected_count; i++) {
+            if (failed[i])
+                fprintf(stderr, "Cannot read relay %s state!\n", uhid_relay_serial(selected[i]));
+        }
+        rc = -1;
+    }
+    if (rc == 0) {
+        f = create_file(path, tmp, sizeof(tmp));
+        if (!f) {
+            rc = -1;
+        } else {
+            fputs(STATE_HEADER, f);
+            for (i = 0; i < selected_count; i++) {
+                uint32_t mask = selected_ports[i] & relay_ports(selected[i]);
+                fprintf(f, "%s %x %x\n", uhid_relay_serial(selected[i]), mask, bitmaps[i] & mask);
+            }
+            rc = commit_file(f, path, tmp);
+        }
+    }
+    if (rc == 0)
+        printf("Saved state of %d relay(s) to %s\n", selected_count, path);
+    free(bitmaps);
+    free(failed);
+    return rc;
+}
+
+
+/*
+ * Select relays listed in state file, with their saved ports.
+ * Relays which are not connected now are skipped with warning.
+ * values[] receives saved state, indexed like selected[].
+ * Returns count of selected relays, or -1 if file is bad.
+ */
+
+static int select_saved_relays(const char* path, uint32_t** values)
+{
+    struct uhid_relay* relay;
+    char line[256];
+    char serial[16];
+    unsigned int mask, state;
+    int max = uhid_max_id(ctx);
+    int* index;   /* by relay id: relay is selected */
+    int lineno = 0;
+    int rc = 0;
+    FILE* f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    release_selected();
+    selected = malloc((max + 1) * sizeof(*selected));
+    selected_ports = malloc((max + 1) * sizeof(*selected_ports));
+    *values = malloc((max + 1) * sizeof(**values));
+    index = calloc(max + 1, sizeof(*index));
+    if (!selected || !selected_ports || !*values || !index) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%15s %x %x", serial, &mask, &state) != 3) {
+            fprintf(stderr, "%s:%d: bad state line\n", path, lineno);
+            rc = -1;
+            break;
+        }
+        relay = uhid_open(ctx, serial);
+        if (!relay && errno == EEXIST) {
+            fprintf(stderr, "More than 1 relay has serial %s!\n", serial);
+            rc = -1;
+        } else if (!relay) {
+            fprintf(stderr, "Relay %s not found, skipped.\n", serial);
+        } else if (index[uhid_relay_id(relay)]) {
+            fprintf(stderr, "%s:%d: relay %s is listed again\n", path, lineno, serial);
+            uhid_close(relay);
+            rc = -1;
+        } else {
+            selected[selected_count] = relay;
+            selected_ports[selected_count] = mask;
+            (*values)[selected_count++] = state;
+            index[uhid_relay_id(relay)] = 1;
+        }
+    }
+    fclose(f);
+    free(index);
+    if (rc < 0) {
+        release_selected();
+        return -1;
+    }
+    return selected_count;
+}
+
+
+/*
+ * Restore relays from state file.  Current state of all relays is read
+ * in parallel, and only ports that differ are written, all relays together.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int restore_state(const char* path)
+{
+    struct transaction tx;
+    uint32_t* values = NULL;
+    uint32_t changed;
+    char buf[128];
+    int rc;
+    int i;
+
+    if (select_saved_relays(path, &values) < 0) {
+        free(values);
+        return -1;
+    }
+    lock_selected(1);
+    rc = transaction_begin(&tx);
+    if (rc < 0) {
+        fprintf(stderr, "Nothing was changed.\n");
+    } else {
+        rc = set_relays_state(&tx, selected_ports, values, NULL);
+        if (rc < 0) {
+            fprintf(stderr, "Cannot restore state!\n");
+            transaction_rollback(&tx);
+        }
+    }
+    for (i = 0; rc == 0 && i < selected_count; i++) {
+        changed = (tx.snapshot[i] ^ values[i]) & selected_ports[i];
+        if (changed)
+            printf("Relay %s: ports %s restored\n", uhid_relay_serial(selected[i]),
+                bitmap2ports(changed, buf, sizeof(buf)));
+        else
+            printf("Relay %s: unchanged\n", uhid_relay_serial(selected[i]));
+    }
+    transaction_free(&tx);
+    free(values);
+    return rc;
+}
+
+
+/*
+ * Relay being provisioned, with its USB location,
+ * or device path if location is not known.
+ */
+struct board {
+    struct uhid_relay* relay;
+    char place[256];
+};
+
+
+/*
+ * Compare board places so that numbers are ordered by value,
+ * e.g. 1-1.2 comes before 1-1.10.
+ */
+
+static int compare_boards(const void* a, const void* b)
+{
+    const char* p = ((const struct board*)a)->place;
+    const char* q = ((const struct board*)b)->place;
+    while (*p && *q) {
+        if (isdigit((unsigned char)*p) && isdigit((unsigned char)*q)) {
+            unsigned long x = strtoul(p, (char**)&p, 10);
+            unsigned long y = strtoul(q, (char**)&q, 10);
+            if (x != y)
+                return x < y ? -1 : 1;
+        } else if (*p != *q) {
+            return (unsigned char)*p - (unsigned char)*q;
+        } else {
+            p++;
+            q++;
+        }
+    }
+    return (unsigned char)*p - (unsigned char)*q;
+}
+
+
+/*
+ * Make serial number from pattern, last run of '#' is replaced
+ * with number.  Returns 0 on success, -1 if number does not fit.
+ */
+
+static int pattern_serial(const char* pattern, unsigned long number, char* serial)
+{
+    const char* end = strrchr(pattern, '#');
+    int len = strlen(pattern);
+    int i;
+
+    strcpy(serial, pattern);
+    for (i = end - pattern; i >= 0 && pattern[i] == '#'; i--) {
+        serial[i] = '0' + number % 10;
+        number /= 10;
+    }
+    return (number || len > UHID_SERIAL_LEN) ? -1 : 0;
+}
+
+
+/*
+ * Give every selected relay unique serial number generated from pattern,
+ * in order of USB locations (or device paths, where location is not known),
+ * so same USB port gets same serial number every time.
+ * Numbers used by relays which are not selected are skipped.
+ * All relays are written in parallel, and each is verified by reading back.
+ * Mapping of locations to new serial numbers is printed and saved to mappath.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int provision(const char* pattern, const char* mappath)
+{
+    struct board* boards;
+    struct uhid_relay** relays;
+    struct uhid_relay** found;
+    char (*serials)[UHID_SERIAL_LEN + 1];
+    const char** names;
+    char tmp[1024];
+    unsigned long number = 1;
+    int* failed;
+    int* index;   /* by relay id: relay is provisioned */
+    int max = uhid_max_id(ctx);
+    int rc = 0;
+    FILE* f = NULL;
+    int taken;
+    int i, k, n;
+
+    if (!strchr(pattern, '#') || strlen(pattern) > UHID_SERIAL_LEN) {
+        fprintf(stderr, "Serial number pattern %s must have '#' and length <=%d!\n",
+            pattern, UHID_SERIAL_LEN);
+        return -1;
+    }
+    boards  = malloc((selected_count + 1) * sizeof(*boards));
+    relays  = malloc((selected_count + 1) * sizeof(*relays));
+    serials = malloc((selected_count + 1) * sizeof(*serials));
+    names   = malloc((selected_count + 1) * sizeof(*names));
+    failed  = malloc((selected_count + 1) * sizeof(*failed));
+    index   = calloc(max + 1, sizeof(*index));
+    found   = malloc((max + 1) * sizeof(*found));
+    if (!boards || !relays || !serials || !names || !failed || !index || !found) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    for (i = 0; i < selected_count; i++) {
+        boards[i].relay = selected[i];
+        if (uhid_path_location(uhid_relay_path(selected[i]), boards[i].place,
+                               sizeof(boards[i].place)) < 0)
+            snprintf(boards[i].place, sizeof(boards[i].place), "%s", uhid_relay_path(selected[i]));
+    }
+    qsort(boards, selected_count, sizeof(*boards), compare_boards);
+    for (i = 0; i < selected_count; i++) {
+        relays[i] = boards[i].relay;
+        index[uhid_relay_id(relays[i])] = 1;
+    }
+    for (i = 0; i < selected_count && rc == 0; i++) {
+        for (;; number++) {
+            if (pattern_serial(pattern, number, serials[i]) < 0) {
+                fprintf(stderr, "Pattern %s has no serial numbers left for %d relay(s)!\n",
+                    pattern, selected_count);
+                rc = -1;
+                break;
+            }
+            /* skip serial kept by some relay which is not provisioned */
+            n = uhid_find(ctx, serials[i], found, max);
+            for (k = 0, taken = 0; k < n && k < max; k++) {
+                taken |= !index[uhid_relay_id(found[k])];
+                uhid_close(found[k]);
+            }
+            if (!taken)
+                break;
+        }
+        names[i] = serials[i];
+        number++;
+    }
+    if (rc == 0 && mappath) {
+        f = create_file(mappath, tmp, sizeof(tmp));
+        if (!f)
+            rc = -1;
+    }
+    if (rc == 0) {
+        uhid_set_serials(relays, selected_count, names, failed);
+        if (f)
+            fputs("# SERIAL LOCATION\n", f);
+        for (i = 0; i < selected_count; i++) {
+            if (failed[i]) {
+                fprintf(stderr, "Relay %s at %s: setting serial %s FAILED\n",
+                    uhid_relay_serial(relays[i]), boards[i].place, serials[i]);
+                rc = -1;
+                continue;
+            }
+            printf("%s %s\n", serials[i], boards[i].place);
+            if (f)
+                fprintf(f, "%s %s\n", serials[i], boards[i].place);
+        }
+        if (f && commit_file(f, mappath, tmp) < 0)
+            rc = -1;
+    }
+    free(boards);
+    free(relays);
+    free(serials);
+    free(names);
+    free(failed);
+    free(index);
+    free(found);
+    return rc;
+}
+
+
+/*
+ * Write rate profiles, one line per relay serial number or relay model:
+ *   KEY RATE P50 P90 P99
+ * RATE is highest rate (writes per second) relay took without dropping
+ * writes (or highest rate tried), and latency percentiles (ms) of single
+ * writes at that rate, without pacing wait.
+ */
+#define PROFILES_HEADER  "# KEY RATE P50 P90 P99\n"
+
+/*
+ * Pace writes to relays by profiles in file, missing file is not an error.
+ * Returns 0 on success, -1 if file is bad.
+ */
+
+static int load_profiles(const char* path)
+{
+    char line[256];
+    char key[16];
+    double rate;
+    int lineno = 0;
+    FILE* f;
+    int rc = 0;
+
+    f = fopen(path, "r");
+    if (!f) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#')
+            continue;
+        if (sscanf(line, "%15s %lf", key, &rate) != 2 || rate <= 0 ||
+            uhid_set_rate(ctx, key, rate) < 0) {
+            fprintf(stderr, "%s:%d: expected KEY RATE P50 P90 P99\n", path, lineno);
+            rc = -1;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+
+/*
+ * Replace profile of key in file (other profiles are kept), or add it.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static int save_profile(const char* path, const char* key, double rate, const double* latency)
+{
+    char line[256];
+    char other[16];
+    char tmp[1024];
+    FILE* in;
+    FILE* f;
+
+    f = create_file(path, tmp, sizeof(tmp));
+    if (!f)
+        return -1;
+    fputs(PROFILES_HEADER, f);
+    in = fopen(path, "r");
+    while (in && fgets(line, sizeof(line), in)) {
+        if (!strcmp(line, PROFILES_HEADER))
+            continue;
+        if (sscanf(line, "%15s", other) == 1 && !strcasecmp(other, key))
+            continue;
+        fputs(line, f);
+    }
+    if (in)
+        fclose(in);
+    fprintf(f, "%s %g %.2f %.2f %.2f\n", key, rate, latency[0], latency[1], latency[2]);
+    return commit_file(f, path, tmp);
+}
+
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Find highest write rate relay takes without dropping writes.
+ * At every rate, ports are switched back and forth between two patterns,
+ * so every switch is written port by port, paced at that rate, and relay
+ * is read back after every switch.  Relay state is restored afterwards.
+ * Latency is time every write took in device, without pacing wait.
+ * Profile is saved for serial number of relay, or for its model.
+ * Returns 0 on success, -1 if error occured.
+ */
+
+static const double calibrate_rates[] = { 25, 50, 100, 200, 400, 800, 1600 };
+
+/* Writes at every rate, enough for p99 not to be just the slowest one */
+#define CALIBRATE_WRITES  200
+
+/* Nearest rank percentile of n sorted latencies */
+#define CALIBRATE_PCT(latency, n, p)  ((latency)[((n) * (p) + 99) / 100 - 1])
+
+static int calibrate(struct uhid_relay* relay, int by_model, const char* path)
+{
+    const char* serial = uhid_relay_serial(relay);
+    uint32_t all = relay_ports(relay);
+    uint32_t patterns[2];
+    uint32_t saved;
+    uint32_t state;
+    double latency[CALIBRATE_WRITES + UHID_MAX_PORTS];
+    double best_latency[3] = { 0, 0, 0 };
+    double best = 0;
+    char key[16];
+    int rounds;
+    int dropped;
+    int n, r, k;
+    int rc = 0;
+
+    if (by_model)
+        snprintf(key, sizeof(key), "USBRelay%d", uhid_relay_nports(relay));
+    else
+        snprintf(key, sizeof(key), "%s", serial);
+    if (uhid_get_bitmap(relay, &saved) < 0) {
+        fprintf(stderr, "Cannot read relay %s state!\n", serial);
+        return -1;
+    }
+    patterns[0] = 0x55555555U & all;
+    patterns[1] = 0xAAAAAAAAU & all;
+    /* every switch writes every port */
+    rounds = (CALIBRATE_WRITES + uhid_relay_nports(relay) - 1) / uhid_relay_nports(relay);
+    printf("Calibrating relay %s, %d ports:\n", serial, uhid_relay_nports(relay));
+    for (r = 0; r < (int)(sizeof(calibrate_rates) / sizeof(calibrate_rates[0])) && rc == 0; r++) {
+        uhid_set_rate(ctx, serial, calibrate_rates[r]);
+        dropped = 0;
+        n = 0;
+        for (k = 0; k < rounds; k++) {
+            if (uhid_set_bitmap(relay, all, patterns[k % 2], NULL) < 0) {
+                rc = -1;
+                break;
+            }
+            n += uhid_write_times(relay, latency + n, sizeof(latency) / sizeof(latency[0]) - n);
+            if (uhid_get_bitmap(relay, &state) < 0) {
+                rc = -1;
+                break;
+            }
+            for (state ^= patterns[k % 2]; state; state &= state - 1)
+                dropped++;
+        }
+        if (rc < 0) {
+            fprintf(stderr, "Relay %s failed at %g writes/s!\n", serial, calibrate_rates[r]);
+            break;
+        }
+        printf("  %5g writes/s: ", calibrate_rates[r]);
+        if (dropped) {
+            printf("%d writes dropped\n", dropped);
+            break;
+        }
+        if (n == 0) {
+            printf("no writes timed\n");
+            rc = -1;
+            break;
+        }
+        qsort(latency, n, sizeof(*latency), compare_doubles);
+        best = calibrate_rates[r];
+        best_latency[0] = CALIBRATE_PCT(latency, n, 50);
+        best_latency[1] = CALIBRATE_PCT(latency, n, 90);
+        best_latency[2] = CALIBRATE_PCT(latency, n, 99);
+        printf("OK, latency p50 %.2f ms, p90 %.2f ms, p99 %.2f ms\n",
+            best_latency[0], best_latency[1], best_latency[2]);
+    }
+    uhid_set_rate(ctx, serial, 0);
+    if (uhid_set_bitmap(relay, all, saved, NULL) < 0) {
+        fprintf(stderr, "Cannot restore relay %s state!\n", serial);
+        rc = -1;
+    }
+    if (rc < 0)
+        return rc;
+    if (best == 0) {
+        fprintf(stderr, "Relay %s drops writes even at %g writes/s!\n", serial, calibrate_rates[0]);
+        return -1;
+    }
+    if (save_profile(path, key, best, best_latency) < 0)
+        return -1;
+    printf("Saved %g writes/s for %s to %s\n", best, key, path);
+    if (r == (int)(sizeof(calibrate_rates) / sizeof(calibrate_rates[0])))
+        printf("No writes were dropped even at highest rate tried, relay may take more.\n");
+    return 0;
+}
+
+
+#if !defined(_WIN32)
+
+/*
+ * Daemon mode.
+ * Clients connect to unix socket and send one command per line:
+ *   list
+ *   status [RELAY [PORTS]]
+ *   off|on|cycle RELAY [PORTS [DELAY]]
+ *   stats
+ * Every reply is zero or more data lines, followed by line
+ * starting with OK or ERR.  Data lines are "SERIAL NPORTS PATH" for list,
+ * and "SERIAL NPORTS BITMAP" for all other commands, bitmap is in hex.
+ */
+
+#define DAEMON_LINE_MAX  1024
+#define DAEMON_OUT_MAX   4096          /* reply is flushed when buffer fills up */
+#define DAEMON_ARENA     (64 * 1024)   /* scratch memory for one command */
+
+/*
+ * Connection state.  Everything command handling needs is preallocated
+ * here when client connects, so commands never allocate memory.
+ */
+struct client {
+    int fd;
+    int gone;                        /* write failed, client went away */
+    uint32_t uid;                    /* peer user and process id, -1 if unknown */
+    uint32_t pid;
+    char in[DAEMON_LINE_MAX];
+    size_t inlen;
+    char out[DAEMON_OUT_MAX];
+    size_t outlen;
+    uint64_t arena[DAEMON_ARENA / sizeof(uint64_t)]; /* reset for every command */
+    size_t arena_used;
+};
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+/* Held for reading while client command runs, see run_daemon() */
+static pthread_rwlock_t clients_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Counters reported by stats command */
+static unsigned long daemon_requests = 0;
+static unsigned long daemon_allocs = 0;
+
+static void daemon_signal(int sig)
+{
+    (void)sig;
+    daemon_stop = 1;
+}
+
+
+/*
+ * Allocate memory in daemon, counted for stats command.
+ * Only daemon's own allocations are counted, not those made by libc
+ * for client threads or by hidapi and libusb.
+ */
+
+static void* daemon_alloc(size_t size)
+{
+    __atomic_add_fetch(&daemon_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+
+/*
+ * Take scratch memory for current command from client arena.
+ * Returns NULL if arena is exhausted.
+ */
+
+static void* arena_alloc(struct client* c, size_t size)
+{
+    void* ptr;
+    size = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    if (size > sizeof(c->arena) - c->arena_used)
+        return NULL;
+    ptr = (char*)c->arena + c->arena_used;
+    c->arena_used += size;
+    return ptr;
+}
+
+
+/*
+ * Send buffered reply to client.
+ * Returns 0 on success, -1 if client went away.
+ */
+
+static int client_flush(struct client* c)
+{
+    size_t pos = 0;
+    while (pos < c->outlen && !c->gone) {
+        ssize_t n = write(c->fd, c->out + pos, c->outlen - pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            c->gone = 1;
+        else
+            pos += n;
+    }
+    c->outlen = 0;
+    return c->gone ? -1 : 0;
+}
+
+
+/*
+ * Add formatted line to reply.
+ * Returns 0 on success, -1 if client went away.
+ */
+
+static int client_printf(struct client* c, const char* fmt, ...)
+{
+    va_list ap;
+    int len;
+    int retry;
+    for (retry = 0; retry < 2; retry++) {
+        va_start(ap, fmt);
+        len = vsnprintf(c->out + c->outlen, sizeof(c->out) - c->outlen, fmt, ap);
+        va_end(ap);
+        if (len < 0)
+            return -1;
+        if ((size_t)len < sizeof(c->out) - c->outlen) {
+            c->outlen += len;
+            break;
+        }
+        if (c->outlen == 0) {
+            /* Line is longer than buffer, truncate it */
+            c->outlen = sizeof(c->out) - 1;
+            c->out[c->outlen - 1] = '\n';
+            break;
+        }
+        if (client_flush(c) < 0)
+            return -1;
+    }
+    return c->gone ? -1 : 0;
+}
+
+
+/*
+ * Find relay addressed by client, serial number must be unique.
+ * Returns referenced relay, release it with uhid_close().
+ */
+
+static struct uhid_relay* daemon_find_relay(struct client* c, const char* serial)
+{
+    struct uhid_relay* relay = NULL;
+    if (!serial) {
+        if (uhid_list(ctx, &relay, 1) != 1) {
+            uhid_close(relay);
+            relay = NULL;
+            client_printf(c, "ERR choose relay\n");
+        }
+        return relay;
+    }
+    relay = uhid_open(ctx, serial);
+    if (!relay && errno == EEXIST)
+        client_printf(c, "ERR relay %s is not unique\n", serial);
+    else if (!relay)
+        client_printf(c, "ERR relay %s not found\n", serial);
+    return relay;
+}
+
+
+/*
+ * Reply with relay state.
+ */
+
+static int daemon_reply(struct client* c, struct uhid_relay* relay, int rc, uint32_t bitmap)
+{
+    if (rc < 0)
+        return client_printf(c, "ERR relay %s failed\n", uhid_relay_serial(relay));
+    return client_printf(c, "%s %d %x\n", uhid_relay_serial(relay), uhid_relay_nports(relay), bitmap);
+}
+
+
+/*
+ * Get referenced array of all relays from client arena,
+ * with room for one bitmap and one flag per relay,
+ * and extra bytes per relay left in arena for two more arrays.
+ * Returns count of relays, or -1 (with error reply) if they don't fit.
+ */
+
+static int list_relays(struct client* c, size_t extra, struct uhid_relay*** relays,
+                       uint32_t** bitmaps, int** failed)
+{
+    size_t avail = sizeof(c->arena) - c->arena_used - 5 * sizeof(uint64_t);
+    int max = avail / (sizeof(**relays) + sizeof(**bitmaps) + sizeof(**failed) + extra);
+    int count;
+    int i;
+
+    *relays  = arena_alloc(c, max * sizeof(**relays));
+    *bitmaps = arena_alloc(c, max * sizeof(**bitmaps));
+    *failed  = arena_alloc(c, max * sizeof(**failed));
+    count = uhid_list(ctx, *relays, max);
+    if (count > max) {
+        for (i = 0; i < max; i++) {
+            uhid_close((*relays)[i]);
+        }
+        client_printf(c, "ERR too many relays\n");
+        return -1;
+    }
+    return count;
+}
+
+
+static int compare_relay_paths(const void* a, const void* b)
+{
+    return strcmp(uhid_relay_path(*(struct uhid_relay* const*)a),
+                  uhid_relay_path(*(struct uhid_relay* const*)b));
+}
+
+
+/*
+ * Reply with state of all relays, which are read in parallel.
+ * Relays are locked shared like for single relay status,
+ * in order of their paths like lock_selected() does.
+ */
+
+static void daemon_status_all(struct client* c, uint32_t portmask)
+{
+    struct uhid_relay** relays;
+    struct uhid_relay** order;
+    uint32_t* bitmaps;
+    int* failed;
+    int* locks;
+    int count;
+    int i;
+
+    count = list_relays(c, sizeof(*order) + sizeof(*locks), &relays, &bitmaps, &failed);
+    if (count < 0)
+        return;
+    order = arena_alloc(c, count * sizeof(*order));
+    locks = arena_alloc(c, count * sizeof(*locks));
+    memcpy(order, relays, count * sizeof(*order));
+    qsort(order, count, sizeof(*order), compare_relay_paths);
+    for (i = 0; i < count; i++) {
+        locks[i] = lock_relay(order[i], 0);
+    }
+    uhid_get_bitmaps(relays, count, bitmaps, failed);
+    for (i = 0; i < count; i++) {
+        unlock_relay(locks[i]);
+    }
+    for (i = 0; i < count; i++) {
+        daemon_reply(c, relays[i], failed[i] ? -1 : 0, bitmaps[i] & portmask);
+        uhid_close(relays[i]);
+    }
+    client_printf(c, "OK\n");
+}
+
+
+/*
+ * Execute one client command.
+ */
+
+static void daemon_command(struct client* c, char* line)
+{
+    char* save = NULL;
+    char* cmd    = strtok_r(line, " \t", &save);
+    char* serial = strtok_r(NULL, " \t", &save);
+    char* ports  = strtok_r(NULL, " \t", &save);
+    char* delay  = strtok_r(NULL, " \t", &save);
+    struct uhid_relay** relays;
+    struct uhid_relay* relay;
+    uint32_t portmask = UHID_ALL_PORTS;
+    uint32_t* bitmaps;
+    uint32_t result;
+    int* failed;
+    int count;
+    int action;
+    int lock;
+    int rc;
+    int i;
+
+    if (!cmd)
+        return;
+    __atomic_add_fetch(&daemon_requests, 1, __ATOMIC_RELAXED);
+    c->arena_used = 0;
+    if (ports) {
+        portmask = ports2bitmap(ports);
+        if (!portmask) {
+            client_printf(c, "ERR bad port list %s\n", ports);
+            return;
+        }
+    }
+
+    if (!strcasecmp(cmd, "list")) {
+        count = list_relays(c, 0, &relays, &bitmaps, &failed);
+        for (i = 0; i < count; i++) {
+            client_printf(c, "%s %d %s\n", uhid_relay_serial(relays[i]),
+                          uhid_relay_nports(relays[i]), uhid_relay_path(relays[i]));
+            uhid_close(relays[i]);
+        }
+        if (count >= 0)
+            client_printf(c, "OK\n");
+        return;
+    }
+    if (!strcasecmp(cmd, "stats")) {
+        client_printf(c, "requests %lu allocs %lu library_allocs %lu\nOK\n",
+                      __atomic_load_n(&daemon_requests, __ATOMIC_RELAXED),
+                      __atomic_load_n(&daemon_allocs, __ATOMIC_RELAXED),
+                      uhid_alloc_count(ctx));
+        return;
+    }
+    if (!strcasecmp(cmd, "status")) {
+        if (!serial) {
+            daemon_status_all(c, portmask);
+            return;
+        }
+        action = POWER_KEEP;
+    } else if (!strcasecmp(cmd, "off")) {
+        action = POWER_OFF;
+    } else if (!strcasecmp(cmd, "on")) {
+        action = POWER_ON;
+    } else if (!strcasecmp(cmd, "cycle")) {
+        action = POWER_CYCLE;
+    } else {
+        client_printf(c, "ERR unknown command %s\n", cmd);
+        return;
+    }
+
+    relay = daemon_find_relay(c, serial);
+    if (!relay)
+        return;
+    result = 0;
+    lock = lock_relay(relay, action != POWER_KEEP);
+    if (action == POWER_KEEP)
+        rc = uhid_get_bitmap(relay, &result);
+    else
+        rc = switch_relay(relay, action, portmask, delay ? atof(delay) : opt_delay, &result,
+                          c->uid, c->pid);
+    unlock_relay(lock);
+    if (!daemon_reply(c, relay, rc, result & portmask) && rc == 0)
+        client_printf(c, "OK\n");
+    uhid_close(relay);
+}
+
+
+/* Find out who is connected, for audit log */
+
+static void client_credentials(struct client* c)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        c->uid = cred.uid;
+        c->pid = cred.pid;
+        return;
+    }
+#endif
+    c->uid = c->pid = (uint32_t)-1;
+}
+
+
+static void* client_thread(void* arg)
+{
+    struct client* c = arg;
+    char* nl;
+    ssize_t n;
+
+    while (!c->gone) {
+        n = read(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        c->inlen += n;
+        while ((nl = memchr(c->in, '\n', c->inlen)) != NULL) {
+            *nl = 0;
+            if (nl > c->in && nl[-1] == '\r')
+                nl[-1] = 0;
+            pthread_rwlock_rdlock(&clients_lock);
+            daemon_command(c, c->in);
+            pthread_rwlock_unlock(&clients_lock);
+            client_flush(c);
+            c->inlen -= nl + 1 - c->in;
+            memmove(c->in, nl + 1, c->inlen);
+        }
+        if (c->inlen == sizeof(c->in) - 1) {
+            client_printf(c, "ERR line too long\n");
+            client_flush(c);
+            c->inlen = 0;
+        }
+    }
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+
+/*
+ * Serve client requests on unix socket until terminated.
+ * Returns 0 on clean shutdown, 1 on error.
+ */
+
+static int run_daemon(const char* sockpath)
+{
+    struct sockaddr_un addr;
+    struct pollfd fds[2];
+    pthread_attr_t attr;
+    pthread_t thread;
+    int nfds = 1;
+    int timeout;
+    int lfd;
+    int cfd;
+    int rc;
+
+    uhid_set_cache_ttl(ctx, opt_cache_ttl);
+    uhid_set_coalesce(ctx, opt_coalesce);
+    uhid_set_dwell(ctx, opt_dwell_on, opt_dwell_off);
+    printf("Found %d relays\n", find_relays());
+    fflush(stdout);
+    report_hotplug = 1;
+
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long!\n", sockpath);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath);
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("Cannot create socket");
+        return 1;
+    }
+    unlink(sockpath);
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 16) < 0) {
+        perror("Cannot listen on socket");
+        close(lfd);
+        return 1;
+    }
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+#if defined(__linux__)
+    fds[1].fd = uhid_monitor_start(ctx);
+    fds[1].events = POLLIN;
+    if (fds[1].fd < 0)
+        perror("Cannot monitor hotplug events");
+    else
+        nfds = 2;
+#endif
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT,  daemon_signal);
+    signal(SIGTERM, daemon_signal);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (!daemon_stop) {
+        timeout = audit_timeout(uhid_monitor_timeout(ctx));
+        rc = poll(fds, nfds, timeout);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            cfd = accept(lfd, NULL, NULL);
+            if (cfd >= 0) {
+                struct client* c = daemon_alloc(sizeof(*c));
+                if (c) {
+                    c->fd = cfd;
+                    c->gone = 0;
+                    c->inlen = c->outlen = c->arena_used = 0;
+                    client_credentials(c);
+                }
+                if (!c || pthread_create(&thread, &attr, client_thread, c) != 0) {
+                    close(cfd);
+                    free(c);
+                }
+            }
+        }
+        if (nfds > 1)
+            uhid_monitor_process(ctx);
+        if (audit_timeout(-1) == 0)
+            audit_flush();
+    }
+
+    pthread_attr_destroy(&attr);
+    close(lfd);
+    uhid_monitor_stop(ctx);
+    unlink(sockpath);
+    /* Wait for clients still talking to relays, and keep them out afterwards */
+    pthread_rwlock_wrlock(&clients_lock);
+    return 0;
+}
+
+#endif /* !_WIN32 */
+
+
+/*
+ * Interactive mode.
+ * Relays stay open between commands, which operate on relay chosen
+ * with "use" (or the only relay).  Every command reports its latency.
+ */
+
+static void repl_help(void)
+{
+    printf(
+        "Commands:\n"
+        "  list                  - list relays\n"
+        "  use [SERIAL]          - choose relay to operate on\n"
+        "  status [PORTS]        - show port status (of all relays if none is chosen)\n"
+        "  on|off [PORTS]        - turn ports on or off [all ports]\n"
+        "  cycle [PORTS [DELAY]] - power cycle ports, DELAY is like 2, 2s or 500ms [%g s]\n"
+        "  rescan                - find relays plugged in or removed\n"
+        "  quit                  - exit\n",
+        opt_delay
+    );
+}
+
+
+/*
+ * Parse delay like 2, 1.5s or 500ms.
+ * Returns delay in seconds, or -1 if invalid.
+ */
+
+static double parse_delay(const char* str)
+{
+    char* end;
+    double delay = strtod(str, &end);
+    if (end == str || delay < 0)
+        return -1;
+    if (!strcasecmp(end, "ms"))
+        return delay / 1000;
+    if (*end && strcasecmp(end, "s"))
+        return -1;
+    return delay;
+}
+
+
+/*
+ * Execute one interactive command on relay *current.
+ * Returns 0 to continue, 1 to quit.
+ */
+
+static int repl_command(char* line, struct uhid_relay** current)
+{
+    char* save = NULL;
+    char* cmd  = strtok_r(line, " \t\r\n", &save);
+    char* arg1 = strtok_r(NULL, " \t\r\n", &save);
+    char* arg2 = strtok_r(NULL, " \t\r\n", &save);
+    struct uhid_relay* relay;
+    uint32_t ports = UHID_ALL_PORTS;
+    uint32_t bitmap;
+    double delay = opt_delay;
+    int count;
+    int lock;
+    int rc = 0;
+    int i;
+
+    if (!cmd)
+        return 0;
+    if (!strcasecmp(cmd, "quit") || !strcasecmp(cmd, "exit"))
+        return 1;
+    if (!strcasecmp(cmd, "help") || !strcmp(cmd, "?")) {
+        repl_help();
+        return 0;
+    }
+    if (!strcasecmp(cmd, "rescan")) {
+        count = find_relays();
+        if (*current && !(relay = uhid_open_path(ctx, uhid_relay_path(*current)))) {
+            printf("Relay %s is gone\n", uhid_relay_serial(*current));
+            uhid_close(*current);
+            *current = NULL;
+        } else if (*current) {
+            uhid_close(relay);
+        }
+        printf("Found %d relays\n", count);
+        return 0;
+    }
+    if (!strcasecmp(cmd, "list")) {
+        count = select_relays(NULL, 0);
+        for (i = 0; i < count; i++) {
+            printf("%s%s %d %s\n", selected[i] == *current ? "*" : " ",
+                uhid_relay_serial(selected[i]), uhid_relay_nports(selected[i]),
+                uhid_relay_path(selected[i]));
+        }
+        release_selected();
+        return 0;
+    }
+    if (!strcasecmp(cmd, "use")) {
+        if (!arg1) {
+            if (*current)
+                printf("Using relay %s\n", uhid_relay_serial(*current));
+            else
+                printf("No relay chosen\n");
+            return 0;
+        }
+        relay = uhid_open(ctx, arg1);
+        if (!relay) {
+            printf("Relay %s %s\n", arg1, errno == EEXIST ? "is not unique" : "not found");
+            return 0;
+        }
+        uhid_close(*current);
+        *current = relay;
+        printf("Using relay %s, %d ports\n", uhid_relay_serial(relay), uhid_relay_nports(relay));
+        return 0;
+    }
+
+    if (arg1) {
+        ports = ports2bitmap(arg1);
+        if (!ports)
+            return 0;
+    }
+    if (!strcasecmp(cmd, "status") && !*current) {
+        count = select_relays(NULL, 0);
+        lock_selected(0);
+        for (i = 0; i < count; i++) {
+            print_relay_status(selected[i], ports);
+        }
+        release_selected();
+        return 0;
+    }
+    if (strcasecmp(cmd, "status") && strcasecmp(cmd, "on") &&
+        strcasecmp(cmd, "off") && strcasecmp(cmd, "cycle")) {
+        printf("Unknown command %s, type help to list commands\n", cmd);
+        return 0;
+    }
+    if (!*current) {
+        printf("Choose relay with use SERIAL\n");
+        return 0;
+    }
+    if (!strcasecmp(cmd, "status")) {
+        lock = lock_relay(*current, 0);
+        print_relay_status(*current, ports);
+        unlock_relay(lock);
+        return 0;
+    }
+    if (arg2 && (delay = parse_delay(arg2)) < 0) {
+        printf("Bad delay %s\n", arg2);
+        return 0;
+    }
+    lock = lock_relay(*current, 1);
+    rc = switch_relay(*current, !strcasecmp(cmd, "cycle") ? POWER_CYCLE :
+                      !strcasecmp(cmd, "on") ? POWER_ON : POWER_OFF,
+                      ports, delay, &bitmap, caller_uid(), caller_pid());
+    unlock_relay(lock);
+    /* Interactive commands come slowly, their records are not kept waiting */
+    audit_flush();
+    if (rc < 0) {
+        printf("Cannot set relay %s state!\n", uhid_relay_serial(*current));
+        return 0;
+    }
+    print_ports(*current, ports, bitmap);
+    return 0;
+}
+
+
+static int run_repl(void)
+{
+    struct uhid_relay* current = NULL;
+    char line[256];
+    double started;
+    int done = 0;
+
+    printf("Found %d relays, type help to list commands\n", find_relays());
+    if (uhid_list(ctx, &current, 1) != 1) {
+        uhid_close(current);
+        current = NULL;
+    }
+    while (!done) {
+        if (current)
+            printf("uhidctl %s> ", uhid_relay_serial(current));
+        else
+            printf("uhidctl> ");
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), stdin))
+            break;
+        started = now_ms();
+        done = repl_command(line, &current);
+        if (!done && strspn(line, " \t\r\n") != strlen(line))
+            printf("(%.1f ms)\n", now_ms() - started);
+    }
+    uhid_close(current);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct port_list relay_list = { NULL, 0, 0, -1 };
+    char* end;
     int rc = 0;
     int c = 0;
     int option_index = 0;
     int i;
 
     for (;;) {
-        c = getopt_long(argc, argv, "a:d:p:l:s:hv", long_options, &option_index);
+        c = getopt_long(argc, argv, "a:d:p:l:L:g:x:o:c:f:s:S:R:P:M:A:Q:C::F:D:iT:W:w:b:hv", long_options, &option_index);
         if (c == -1)
             break;  /* no more options left */
         switch (c) {
@@ -376,19 +3290,34 @@ int main(int argc, char *argv[])
             printf("\n");
             break;
         case 'l':
-            strncpy(opt_relay, optarg, sizeof(opt_relay));
+            opt_relay = optarg;
+            break;
+        case 'L':
+            opt_location = optarg;
             break;
         case 's':
             strncpy(opt_newserial, optarg, sizeof(opt_newserial));
             break;
         case 'p':
-            if (!strcasecmp(optarg, "all")) { /* all ports is the default */
-                break;
+            if (port_args_count == MAX_ACTIONS) {
+                fprintf(stderr, "Too many port lists, max is %d!\n", MAX_ACTIONS);
+                exit(1);
             }
-            if (strlen(optarg)) {
+            opt_relay_ports = NULL;
+            opt_ports = UHID_ALL_PORTS;
+            if (!strcasecmp(optarg, "all")) { /* all ports is the default */
+            } else if (strchr(optarg, ':')) {
+                /* relay-qualified port list, resolved with relays */
+                opt_relay_ports = optarg;
+            } else if (strlen(optarg)) {
                 /* parse port list */
                 opt_ports = ports2bitmap(optarg);
+                if (!opt_ports)
+                    exit(1);
             }
+            port_args[port_args_count].ports = opt_ports;
+            port_args[port_args_count].relay_ports = opt_relay_ports;
+            port_args_count++;
             break;
         case 'a':
             if (!strcasecmp(optarg, "off")          || !strcasecmp(optarg, "0")) {
@@ -401,10 +3330,112 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "Invalid power action: %s. Run with -h to get usage info.\n", optarg);
                 exit(1);
             }
+            if (actions_count == MAX_ACTIONS) {
+                fprintf(stderr, "Too many actions, max is %d!\n", MAX_ACTIONS);
+                exit(1);
+            }
+            actions[actions_count++] = opt_action;
             break;
         case 'd':
             opt_delay = atof(optarg);
             break;
+        case 'g':
+            opt_group = optarg;
+            break;
+        case 'x':
+            opt_exclude = optarg;
+            break;
+        case 'o':
+            if (!strcasecmp(optarg, "on")) {
+                opt_only = POWER_ON;
+            } else if (!strcasecmp(optarg, "off")) {
+                opt_only = POWER_OFF;
+            } else {
+                fprintf(stderr, "Invalid port state: %s. Run with -h to get usage info.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            opt_config = optarg;
+            break;
+        case 'S':
+            opt_save_state = optarg;
+            break;
+        case 'R':
+            opt_restore_state = optarg;
+            break;
+        case 'P':
+            opt_provision = optarg;
+            break;
+        case 'M':
+            opt_map = optarg;
+            break;
+        case 'f':
+            if (!strcasecmp(optarg, "text")) {
+                opt_format = FORMAT_TEXT;
+            } else if (!strcasecmp(optarg, "json")) {
+                opt_format = FORMAT_JSON;
+            } else if (!strcasecmp(optarg, "jsonl")) {
+                opt_format = FORMAT_JSONL;
+            } else if (!strcasecmp(optarg, "csv")) {
+                opt_format = FORMAT_CSV;
+            } else {
+                fprintf(stderr, "Invalid format: %s. Run with -h to get usage info.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'A':
+            opt_audit = optarg;
+            break;
+        case 'Q':
+            opt_query = optarg;
+            break;
+        case 'C':
+            opt_calibrate = optarg ? optarg : "serial";
+            if (strcasecmp(opt_calibrate, "serial") && strcasecmp(opt_calibrate, "model")) {
+                fprintf(stderr, "Invalid calibrate key: %s. Run with -h to get usage info.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'F':
+            opt_profiles = optarg;
+            break;
+        case 'D':
+            opt_daemon = optarg;
+            break;
+        case 'i':
+            opt_interactive = 1;
+            break;
+        case 'T':
+            opt_cache_ttl = atof(optarg);
+            break;
+        case 'W':
+            opt_coalesce = atof(optarg);
+            break;
+        case 'w':
+            opt_dwell_on = strtod(optarg, &end);
+            opt_dwell_off = *end == ':' ? strtod(end + 1, &end) : opt_dwell_on;
+            if (*end || opt_dwell_on < 0 || opt_dwell_off < 0) {
+                fprintf(stderr, "Invalid dwell: %s. Run with -h to get usage info.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            if (!strncasecmp(optarg, "bus", 3)) {
+                opt_lanes = UHID_LANES_BUS;
+            } else if (!strncasecmp(optarg, "hub", 3)) {
+                opt_lanes = UHID_LANES_HUB;
+            } else {
+                fprintf(stderr, "Invalid lanes: %s. Run with -h to get usage info.\n", optarg);
+                exit(1);
+            }
+            if (optarg[3] == ':')
+                opt_lane_width = atoi(optarg + 4);
+            if ((optarg[3] && optarg[3] != ':') || opt_lane_width <= 0) {
+                fprintf(stderr, "Invalid lanes: %s. Run with -h to get usage info.\n", optarg);
+                exit(1);
+            }
+            break;
         case 'v':
             printf("%s\n", PROGRAM_VERSION);
             exit(0);
@@ -422,20 +3453,65 @@ int main(int argc, char *argv[])
             abort();
         }
     }
+    if (port_args_count > 1 && port_args_count != actions_count) {
+        fprintf(stderr, "With several -p, every -a needs its own -p!\n");
+        exit(1);
+    }
+    if (port_args_count > 1 || actions_count > 1) {
+        /* Relays are selected by all relay-qualified port lists together */
+        opt_relay_ports = NULL;
+        opt_ports = UHID_ALL_PORTS;
+        for (i = 0; i < port_args_count; i++) {
+            if (port_args[i].relay_ports)
+                opt_relay_ports = port_args[i].relay_ports;
+        }
+    }
     if (optind < argc) {
         /* non-option parameters are found? */
         fprintf(stderr, "Invalid command line syntax!\n");
         fprintf(stderr, "Run with -h to get usage info.\n");
         exit(1);
     }
+    if (opt_query) {
+        if (!opt_audit) {
+            fprintf(stderr, "Give audit log to query with -A!\n");
+            exit(1);
+        }
+        return audit_query(opt_audit, opt_query, opt_relay) < 0 ? 1 : 0;
+    }
+    if (opt_audit && audit_open(opt_audit) < 0)
+        exit(1);
 
-    rc = hid_init();
-    if (rc < 0) {
+    ctx = uhid_new();
+    if (!ctx) {
         fprintf(stderr, "Error initializing hidapi!\n");
         exit(1);
     }
+    uhid_set_event_cb(ctx, relay_event, NULL);
+    uhid_set_lanes(ctx, opt_lanes, opt_lane_width);
+    /* Calibration measures relay alone, without pacing from old profiles */
+    if (!opt_calibrate && load_profiles(opt_profiles) < 0) {
+        rc = 1;
+        goto cleanup;
+    }
+
+#if !defined(_WIN32)
+    if (opt_daemon) {
+        rc = run_daemon(opt_daemon);
+        goto cleanup;
+    }
+#endif
+    if (opt_interactive) {
+        rc = run_repl();
+        goto cleanup;
+    }
 
-    rc = find_relays();
+    if (opt_location && !opt_restore_state) {
+        /* Relays at given locations are opened alone, without enumeration */
+        rc = 1;
+    } else {
+        rc = find_relays();
+    }
 
     if (rc <= 0) {
         fprintf(stderr,
@@ -446,9 +3522,71 @@ int main(int argc, char *argv[])
         goto cleanup;
     }
 
+    if (opt_restore_state) {
+        rc = restore_state(opt_restore_state) < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (!!opt_relay + !!opt_location + !!opt_relay_ports + !!opt_group > 1) {
+        fprintf(stderr, "Choose relays with only one of -l, -L, -g or relay-qualified ports!\n");
+        rc = 1;
+        goto cleanup;
+    }
+    if (opt_location) {
+        rc = select_locations(opt_location);
+    } else if (opt_group) {
+        struct group* group;
+        if (load_groups(opt_config) < 0) {
+            rc = 1;
+            goto cleanup;
+        }
+        group = find_group(opt_group);
+        if (!group) {
+            fprintf(stderr, "Group %s is not defined in %s!\n", opt_group, opt_config);
+            rc = 1;
+            goto cleanup;
+        }
+        rc = select_relays(&group->ports, opt_action != POWER_KEEP);
+    } else if (opt_relay) {
+        if (compile_port_list(&relay_list, opt_relay, 0) < 0) {
+            rc = 1;
+            goto cleanup;
+        }
+        rc = select_relays(&relay_list, opt_action != POWER_KEEP);
+    } else if (opt_relay_ports) {
+        for (i = 0; i < port_args_count; i++) {
+            if (port_args[i].relay_ports &&
+                compile_port_list(&relay_list, port_args[i].relay_ports, 1) < 0) {
+                rc = 1;
+                goto cleanup;
+            }
+        }
+        rc = select_relays(&relay_list, opt_action != POWER_KEEP);
+    } else {
+        rc = select_relays(NULL, opt_action != POWER_KEEP);
+    }
+    if (rc < 0) {
+        rc = 1;
+        goto cleanup;
+    }
+    /* Other uhidctl processes wait for relays we change, and we wait for them */
+    lock_selected(opt_action != POWER_KEEP || strlen(opt_newserial) > 0 || opt_provision ||
+                  opt_calibrate);
+    if (opt_exclude || opt_only != POWER_KEEP) {
+        rc = filter_selected();
+        if (rc < 0) {
+            rc = 1;
+            goto cleanup;
+        }
+        if (rc == 0) {
+            printf("No ports left to operate on.\n");
+            goto cleanup;
+        }
+    }
+
     if (strlen(opt_newserial) > 0) {
-        if (relay_count == 1) {
-            rc = set_serial(relays, opt_newserial);
+        if (selected_count == 1) {
+            rc = set_serial(selected[0], opt_newserial);
             if (rc) {
                 fprintf(stderr,
                     "Error setting new serial number!\n"
@@ -464,48 +3602,98 @@ int main(int argc, char *argv[])
         goto cleanup;
     }
 
+    if (opt_save_state) {
+        rc = save_state(opt_save_state) < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (opt_provision) {
+        rc = provision(opt_provision, opt_map) < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (opt_calibrate) {
+        if (selected_count != 1) {
+            fprintf(stderr, "Choose only one relay to calibrate!\n");
+            rc = 1;
+        } else {
+            rc = calibrate(selected[0], !strcasecmp(opt_calibrate, "model"), opt_profiles) < 0 ? 1 : 0;
+        }
+        goto cleanup;
+    }
+
     if (opt_action == POWER_KEEP) {
-        for (i = 0; i < relay_count; i++) {
-            print_relay_status(relays+i, opt_ports);
+        /* All relays are read in parallel */
+        uint32_t* bitmaps = malloc((selected_count + 1) * sizeof(*bitmaps));
+        int* failed = malloc((selected_count + 1) * sizeof(*failed));
+        double started = now_ms();
+        double latency;
+        if (!bitmaps || !failed) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        uhid_get_bitmaps(selected, selected_count, bitmaps, failed);
+        latency = now_ms() - started;
+        for (i = 0; i < selected_count; i++) {
+            output_relay(selected[i], selected_ports[i], bitmaps[i], failed[i] ? -1 : 0, latency);
         }
+        free(bitmaps);
+        free(failed);
         rc = 0;
         goto cleanup;
     }
 
-    if (relay_count > 1) {
+    if (selected_count > 1 && !opt_relay && !opt_location && !opt_relay_ports && !opt_group) {
         fprintf(stderr, "More than 1 relay found, choose one to operate with -l RELAY\n");
-        for (i = 0; i < relay_count; i++) {
-            fprintf(stderr, "%s\n", relays[i].serial);
+        for (i = 0; i < selected_count; i++) {
+            fprintf(stderr, "%s\n", uhid_relay_serial(selected[i]));
         }
         rc = 1;
     } else {
-        int port;
-        int k; /* k=0 for power OFF, k=1 for power ON */
-        for (k=0; k<2; k++) { /* up to 2 power actions - OFF/ON */
-            int state;
-            if (k == 0 && opt_action == POWER_ON )
-                continue;
-            if (k == 1 && opt_action == POWER_OFF)
+        struct transaction tx;
+        struct action_plan plan;
+        int k; /* k=0 for first phase (OFF/ON), k=1 for cycled ports ON */
+        compile_actions(&plan);
+        if (transaction_begin(&tx) < 0) {
+            fprintf(stderr, "Nothing was changed.\n");
+            transaction_free(&tx);
+            action_plan_free(&plan);
+            rc = 1;
+            goto cleanup;
+        }
+        for (k=0; k<2; k++) { /* up to 2 phases */
+            if (k == 1 && !plan.cycle)
                 continue;
-            state = k;
-            for (port=1; port <= relays[0].nports; port++) {
-                if ((1 << (port-1)) & opt_ports) {
-                    rc = set_port_state(&relays[0], port, state);
-                    if (rc < 0) {
-                        fprintf(stderr, "Cannot set new port state!\n");
-                        exit(1);
-                    }
-                }
+            rc = set_relays_state(&tx, plan.masks[k], plan.values[k], plan.cycle ? plan.masks[1] : NULL);
+            if (rc < 0) {
+                fprintf(stderr, "Cannot set new port state!\n");
+                transaction_rollback(&tx);
+                transaction_free(&tx);
+                action_plan_free(&plan);
+                rc = 1;
+                goto cleanup;
+            }
+            /* State was just read back by set_relays_state().
+               Machine readable output has one record per relay, of final state */
+            for (i = 0; i < selected_count && (opt_format == FORMAT_TEXT || k == 1 || !plan.cycle); i++) {
+                output_relay(selected[i], selected_ports[i], tx.current[i], tx.known[i] ? 0 : -1,
+                             tx.latency);
             }
-            print_relay_status(&relays[0], opt_ports);
-            if (k==0 && opt_action == POWER_CYCLE) {
+            if (k==0 && plan.cycle) {
                 sleep_ms(opt_delay * 1000);
             }
         }
+        transaction_free(&tx);
+        action_plan_free(&plan);
         rc = 0;
     }
 
 cleanup:
-    hid_exit();
+    output_end();
+    release_selected();
+    free(relay_list.specs);
+    free_groups();
+    uhid_free(ctx);
+    audit_close();
     return rc;
 }
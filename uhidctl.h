@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2017-2020 Vadim Mikhailov
+ *
+ * libuhidctl - library to control USB HID power relays.
+ *
+ * This file can be distributed under the terms and conditions of the
+ * GNU General Public License version 2.
+ *
+ */
+
+#ifndef UHIDCTL_H
+#define UHIDCTL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * All state lives in context object, there are no globals
+ * (except hidapi initialization, which is reference counted).
+ * Every function is thread safe.  Operations on one relay are serialized,
+ * operations on different relays run in parallel.
+ *
+ * Functions returning int return 0 (or count) on success,
+ * and -1 with errno set if error occured.
+ */
+
+/* Max number of relay ports supported */
+#define UHID_MAX_PORTS   32
+#define UHID_ALL_PORTS   0xFFFFFFFFU /* bitmask */
+#define UHID_PORT_BIT(port)  ((uint32_t)1 << ((port) - 1))
+
+/* Relay serial number is up to 5 characters */
+#define UHID_SERIAL_LEN  5
+
+struct uhid_ctx;
+struct uhid_relay;
+
+/* Events reported to uhid_event_cb */
+#define UHID_EVENT_ADDED        1  /* relay was found by enumeration or plugged in */
+#define UHID_EVENT_REMOVED      2  /* relay was unplugged */
+#define UHID_EVENT_OPEN_FAILED  3  /* relay device can't be opened, permissions? */
+#define UHID_EVENT_UNSUPPORTED  4  /* relay has more than UHID_MAX_PORTS ports */
+
+/* serial is NULL if it is not known (yet) */
+typedef void (*uhid_event_cb)(void* user, int event, const char* serial, const char* path);
+
+
+/*
+ * Context.
+ */
+
+struct uhid_ctx* uhid_new(void);
+
+/* All relays must be closed before context is freed */
+void uhid_free(struct uhid_ctx* ctx);
+
+/* Max age of cached relay state in milliseconds [0, cache disabled] */
+void uhid_set_cache_ttl(struct uhid_ctx* ctx, double ms);
+
+/* Window to merge writes to same relay, in milliseconds [0, disabled] */
+void uhid_set_coalesce(struct uhid_ctx* ctx, double ms);
+
+void uhid_set_event_cb(struct uhid_ctx* ctx, uhid_event_cb cb, void* user);
+
+/*
+ * Min time port stays ON and OFF after it was switched, in milliseconds
+ * [0, disabled].  Writes which would switch port sooner are deferred
+ * until dwell is over, and only last requested state is written then, so
+ * burst of toggles becomes at most one switch.  Such writes complete when
+ * their ports are written.  Only writes made through this context count.
+ */
+void uhid_set_dwell(struct uhid_ctx* ctx, double on_ms, double off_ms);
+
+/*
+ * Pace writes: at most rate writes per second are sent to relay
+ * with serial number key, or to relays of model key (product name,
+ * e.g. USBRelay8) which have no rule of their own.  Rate 0 removes rule.
+ * With any rule, fleet writes are not issued with io_uring.
+ */
+int uhid_set_rate(struct uhid_ctx* ctx, const char* key, double rate);
+
+/* Scheduling lanes, see uhid_set_lanes() */
+#define UHID_LANES_NONE  0  /* relays are not grouped, default */
+#define UHID_LANES_BUS   1  /* one lane per USB bus (host controller) */
+#define UHID_LANES_HUB   2  /* one lane per USB hub */
+
+/*
+ * Group relays into lanes by USB topology (see uhid_path_location()).
+ * At most width relays of one lane are accessed at once [1], while
+ * different lanes run in parallel.  Relays with unknown location get
+ * lane of their own.  With lanes, fleet writes are issued by relay workers
+ * in their lanes, instead of all together.
+ */
+void uhid_set_lanes(struct uhid_ctx* ctx, int lanes, int width);
+
+/*
+ * Count of memory allocations made by context since it was created.
+ * Only enumeration, fleet writes and asynchronous ops allocate,
+ * blocking single relay operations and uhid_get_bitmaps() never do.
+ * Allocations made inside hidapi or libusb are not counted.
+ */
+unsigned long uhid_alloc_count(struct uhid_ctx* ctx);
+
+
+/*
+ * Relay registry.
+ * Relays returned by functions below are referenced,
+ * and must be released with uhid_close().
+ */
+
+/*
+ * Find all USB relays.  Relays already known are kept as is,
+ * relays which are gone are dropped.
+ * Returns count of relays.
+ */
+int uhid_enumerate(struct uhid_ctx* ctx);
+
+/*
+ * Get all relays, in enumeration order.
+ * Up to max relays are stored in relays[].
+ * Returns total count of relays.
+ */
+int uhid_list(struct uhid_ctx* ctx, struct uhid_relay** relays, int max);
+
+/*
+ * Find relays by serial number, case insensitive.
+ * Several relays may share serial number, up to max are stored in relays[].
+ * Returns count of relays with this serial number.
+ */
+int uhid_find(struct uhid_ctx* ctx, const char* serial, struct uhid_relay** relays, int max);
+
+/*
+ * Open relay by unique serial number.
+ * Returns NULL with errno ENOENT if not found, or EEXIST if not unique.
+ */
+struct uhid_relay* uhid_open(struct uhid_ctx* ctx, const char* serial);
+
+/* Open relay by device path */
+struct uhid_relay* uhid_open_path(struct uhid_ctx* ctx, const char* path);
+
+/* Take extra reference to relay */
+struct uhid_relay* uhid_ref(struct uhid_relay* relay);
+
+void uhid_close(struct uhid_relay* relay);
+
+const char* uhid_relay_serial(const struct uhid_relay* relay);
+const char* uhid_relay_path(const struct uhid_relay* relay);
+int         uhid_relay_nports(const struct uhid_relay* relay);
+
+/*
+ * Relay id is small number, unique among relays present in context.
+ * Ids of removed relays are reused.  All ids are below uhid_max_id().
+ */
+int uhid_relay_id(const struct uhid_relay* relay);
+int uhid_max_id(struct uhid_ctx* ctx);
+
+/*
+ * Physical location is USB port chain, as named by sysfs, e.g. 1-1.2.
+ * It is resolved without opening any device (Linux only, ENOSYS elsewhere).
+ */
+
+/* Get location of device path, returns -1 with errno ENOENT if unknown */
+int uhid_path_location(const char* path, char* location, int size);
+
+/*
+ * Open relay at location.  Only that device is opened, if it is not known yet,
+ * so uhid_enumerate() is not needed.
+ * Returns NULL with errno ENOENT if there is no relay, or EINVAL if location is bad.
+ */
+struct uhid_relay* uhid_open_location(struct uhid_ctx* ctx, const char* location);
+
+
+/*
+ * Relay operations.
+ * Port bitmaps have bit 0 for port 1.
+ */
+
+int uhid_get_bitmap(struct uhid_relay* relay, uint32_t* bitmap);
+
+/*
+ * Set ports in mask to state given by bits of value.
+ * Only ports that change are written, with bulk opcodes when possible.
+ * If result is not NULL, it receives new state of all ports.
+ */
+int uhid_set_bitmap(struct uhid_relay* relay, uint32_t mask, uint32_t value, uint32_t* result);
+
+/* Turn ports in mask off, wait delay seconds, turn them on */
+int uhid_cycle(struct uhid_relay* relay, uint32_t mask, double delay, uint32_t* result);
+
+/*
+ * Get time in milliseconds every output report of last write to relay
+ * took, without pacing wait, e.g. after uhid_set_bitmap() returned.
+ * Fleet writes issued with io_uring are not timed.
+ * Returns count of times stored (at most max).
+ */
+int uhid_write_times(struct uhid_relay* relay, double* times, int max);
+
+/*
+ * Set new serial number, up to UHID_SERIAL_LEN characters.
+ * It is read back from relay to verify it was stored.
+ */
+int uhid_set_serial(struct uhid_relay* relay, const char* serial);
+
+/*
+ * Fleet operations on several relays at once.
+ * failed[] is optional, it receives 1 for every relay that failed.
+ * Return 0 if all relays succeeded, -1 otherwise.
+ */
+
+/* Reads of all relays run in parallel (in batches of 64 relays) */
+int uhid_get_bitmaps(struct uhid_relay** relays, int count, uint32_t* bitmaps, int* failed);
+
+/*
+ * All relays are read and planned first, then writes to all of them are
+ * issued together (in one io_uring submission with Linux hidraw backend).
+ */
+int uhid_set_bitmaps(struct uhid_relay** relays, int count, uint32_t mask, uint32_t value,
+                     int* failed);
+
+/* Same as uhid_set_bitmaps(), but relay i gets its own masks[i] and values[i] */
+int uhid_apply_bitmaps(struct uhid_relay** relays, int count, const uint32_t* masks,
+                       const uint32_t* values, int* failed);
+
+/*
+ * Relay i gets serial number serials[i], all relays are written in parallel
+ * (in batches of 64 relays) and verified like uhid_set_serial().
+ */
+int uhid_set_serials(struct uhid_relay** relays, int count, const char* const* serials,
+                     int* failed);
+
+
+/*
+ * Port sets.
+ * Port set holds any ports of any relays of context, packed in dense
+ * bitset indexed by relay id, so set operations on thousands of ports take
+ * few word-wide operations.  Relay ids are reused, so sets should be built
+ * again after relays were removed.
+ */
+
+struct uhid_ports;
+
+/* Returns empty set, or NULL if out of memory */
+struct uhid_ports* uhid_ports_new(struct uhid_ctx* ctx);
+void uhid_ports_free(struct uhid_ports* set);
+void uhid_ports_clear(struct uhid_ports* set);
+
+/* Add or remove ports in mask of relay, add returns -1 if out of memory */
+int      uhid_ports_add(struct uhid_ports* set, const struct uhid_relay* relay, uint32_t mask);
+void     uhid_ports_del(struct uhid_ports* set, const struct uhid_relay* relay, uint32_t mask);
+uint32_t uhid_ports_get(const struct uhid_ports* set, const struct uhid_relay* relay);
+
+/* set |= other, set &= other, set &= ~other */
+int  uhid_ports_or(struct uhid_ports* set, const struct uhid_ports* other);
+void uhid_ports_and(struct uhid_ports* set, const struct uhid_ports* other);
+void uhid_ports_andnot(struct uhid_ports* set, const struct uhid_ports* other);
+
+/* Count of ports in set */
+int uhid_ports_count(const struct uhid_ports* set);
+
+/*
+ * Get relays having ports in set, in id order, referenced.
+ * Up to max relays are stored in relays[], and their ports in masks[] (optional).
+ * Returns total count of relays.
+ */
+int uhid_ports_relays(const struct uhid_ports* set, struct uhid_relay** relays, uint32_t* masks,
+                      int max);
+
+/*
+ * Read ports which are ON into state, from relays having ports in which
+ * (or from all relays, if which is NULL), all relays in parallel.
+ * Relays which can't be read are left out and -1 is returned.
+ */
+int uhid_ports_read(struct uhid_ports* state, const struct uhid_ports* which);
+
+/*
+ * Set ports in mask to state they have in value (NULL turns them off),
+ * with uhid_apply_bitmaps() on all affected relays.
+ */
+int uhid_ports_apply(const struct uhid_ports* mask, const struct uhid_ports* value);
+
+
+/*
+ * Asynchronous operations.
+ * Submit functions queue operation to relay worker and return at once.
+ * When operation completes, cb is called on worker thread (it must not
+ * block), or if cb is NULL, op is queued to context completion queue,
+ * which is read with uhid_reap().  Every op must be freed with uhid_op_free(),
+ * and all ops must be freed before context is freed.
+ */
+
+struct uhid_op;
+
+typedef void (*uhid_op_cb)(struct uhid_op* op, void* user);
+
+/* Returns NULL if op could not be queued */
+struct uhid_op* uhid_submit_get(struct uhid_relay* relay, uhid_op_cb cb, void* user);
+struct uhid_op* uhid_submit_set(struct uhid_relay* relay, uint32_t mask, uint32_t value,
+                                uhid_op_cb cb, void* user);
+
+/*
+ * Get relay state after completed op.
+ * Returns -1 with errno EINPROGRESS if op is not completed yet.
+ */
+int uhid_op_result(const struct uhid_op* op, uint32_t* bitmap);
+
+struct uhid_relay* uhid_op_relay(const struct uhid_op* op);
+void* uhid_op_user(const struct uhid_op* op);
+void  uhid_op_free(struct uhid_op* op);
+
+/*
+ * Get fd which becomes readable when completion queue is not empty
+ * (eventfd on Linux, pipe elsewhere).  It is owned by context.
+ */
+int uhid_completion_fd(struct uhid_ctx* ctx);
+
+/*
+ * Take up to max completed ops from completion queue, in completion order.
+ * Returns count of ops stored in ops[].
+ */
+int uhid_reap(struct uhid_ctx* ctx, struct uhid_op** ops, int max);
+
+
+/*
+ * Hotplug monitoring (Linux only).
+ * Poll fd from uhid_monitor_start() for reading, with timeout returned by
+ * uhid_monitor_timeout(), and call uhid_monitor_process() after poll.
+ * Added and removed relays are reported with UHID_EVENT_ADDED/REMOVED.
+ */
+
+/* Returns fd to poll, or -1 with errno ENOSYS if not supported */
+int  uhid_monitor_start(struct uhid_ctx* ctx);
+int  uhid_monitor_timeout(struct uhid_ctx* ctx);
+void uhid_monitor_process(struct uhid_ctx* ctx);
+void uhid_monitor_stop(struct uhid_ctx* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UHIDCTL_H */